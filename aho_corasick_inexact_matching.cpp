@@ -1,17 +1,36 @@
 #include <cassert>
 #include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <condition_variable>
 #include <cstring>
-#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <queue>
+#include <random>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_set>
 #include <vector>
 #include <stdexcept> 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 //  std::make_unique will be available since c++14
 //  Implementation was taken from http://herbsutter.com/gotw/_102/
@@ -32,177 +51,294 @@ class IteratorRange {
   Iterator begin_, end_;
 };
 
-namespace traverses {
-
-template <class Vertex, class Graph, class Visitor>
-void BreadthFirstSearch(Vertex origin_vertex, const Graph &graph,
-                        Visitor visitor) {
-  std::unordered_set<Vertex> discovered_vertexes;
-  std::queue<Vertex> vertexes_to_process;
-  visitor.DiscoverVertex(origin_vertex);
-  discovered_vertexes.insert(origin_vertex);
-  vertexes_to_process.push(origin_vertex);
-
-  while (!vertexes_to_process.empty()) {
-    Vertex processing_vertex = vertexes_to_process.front();
-    vertexes_to_process.pop();
-    visitor.ExamineVertex(processing_vertex);
-
-    for (const auto &edge : OutgoingEdges(graph, processing_vertex)) {
-      visitor.ExamineEdge(edge);
-
-      Vertex target_vertex = GetTarget(graph, edge);
-      if (discovered_vertexes.count(target_vertex) == 0) {
-        discovered_vertexes.insert(target_vertex);
-        visitor.DiscoverVertex(target_vertex);
-        vertexes_to_process.push(target_vertex);
-      }
-    }
-  }
-}
+namespace aho_corasick {
 
-template <class Vertex, class Edge>
-class BFSVisitor {
- public:
-  virtual void DiscoverVertex(Vertex /*vertex*/) {}
-  virtual void ExamineEdge(const Edge & /*edge*/) {}
-  virtual void ExamineVertex(Vertex /*vertex*/) {}
-  virtual ~BFSVisitor() = default;
-};
+// Rows of the goto table cover every value of a byte
+constexpr size_t kGotoRowSize = 256;
 
-}  // namespace traverses
+// Nodes are stored in breadth-first order, so the root comes first
+constexpr uint32_t kRootNode = 0;
+constexpr uint32_t kNoNode = std::numeric_limits<uint32_t>::max();
 
-namespace aho_corasick {
+// kSparse searches the sorted children of a node and follows suffix
+// links on a missing trie transition, kDoubleArray finds a child with
+// a single probe of a double array instead, and kDense precomputes the
+// goto table, state x byte to state, at Build().
+// Per trie node kSparse takes about 32 bytes, kDoubleArray about 36 and
+// kDense more than 1 KiB
+enum class TransitionsMode { kSparse, kDoubleArray, kDense };
 
+// Nodes live in one array in breadth-first order, so children of a node
+// are consecutive, sorted by character, and every link is an index.
+// Ids of strings which are ended at a node are a range of a shared pool
 struct AutomatonNode {
-  AutomatonNode() : suffix_link(nullptr), terminal_link(nullptr) {}
-  // Stores ids of strings which are ended at this node
-  std::vector<size_t> terminated_string_ids;
-  // Stores tree structure of nodes
-  std::map<char, AutomatonNode> trie_transitions;
-  // Stores pointers to the elements of trie_transitions
-  std::map<char, AutomatonNode *> automaton_transitions_cache;
-  AutomatonNode * suffix_link;
-  AutomatonNode * terminal_link;
+  AutomatonNode()
+      : first_child(kNoNode),
+        children_number(0),
+        suffix_link(kRootNode),
+        terminal_link(kNoNode),
+        first_terminated_string_id(0),
+        terminated_string_ids_number(0),
+        double_array_base(0),
+        character(0) {}
+
+  uint32_t first_child;
+  uint32_t children_number;
+  uint32_t suffix_link;
+  uint32_t terminal_link;
+  uint32_t first_terminated_string_id;
+  uint32_t terminated_string_ids_number;
+  // Base of the children in the double array, in TransitionsMode::kDoubleArray
+  uint32_t double_array_base;
+  // Character of the trie edge entering the node
+  char character;
 };
 
-AutomatonNode * GetTrieTransition(AutomatonNode * node, char character) {
-  auto transition = node->trie_transitions.find(character);
-  return transition != node->trie_transitions.end() ? &(transition->second) : nullptr;
-}
-
-// Provides constant amortized runtime
-AutomatonNode * GetAutomatonTransition(AutomatonNode * node, AutomatonNode * root,
-                                      char character) {
-  auto cached_transition = node->automaton_transitions_cache.find(character);
-  if (cached_transition != node->automaton_transitions_cache.end()) {
-    return cached_transition->second;
-  }
+uint32_t GetTrieTransition(const AutomatonNode * nodes, uint32_t node,
+                           char character) {
+  const unsigned char key = character;
+  uint32_t left = nodes[node].first_child;
+  uint32_t right = left + nodes[node].children_number;
 
-  AutomatonNode * transition_node = GetTrieTransition(node, character);
-  
-  if (transition_node == nullptr) {
-    if (node != root) {
-      transition_node = GetAutomatonTransition(node->suffix_link, root, character);
+  while (left < right) {
+    uint32_t middle = left + (right - left) / 2;
+    if (static_cast<unsigned char>(nodes[middle].character) < key) {
+      left = middle + 1;
     } else {
-      transition_node = root;
+      right = middle;
     }
   }
-  
-  return node->automaton_transitions_cache[character] = transition_node;
+
+  return (left < nodes[node].first_child + nodes[node].children_number &&
+          nodes[left].character == character) ? left : kNoNode;
 }
 
-namespace internal {
+// Provides constant amortized runtime along a scanned text
+uint32_t GetAutomatonTransition(const AutomatonNode * nodes, uint32_t node,
+                                char character) {
+  while (true) {
+    uint32_t transition_node = GetTrieTransition(nodes, node, character);
+    if (transition_node != kNoNode) {
+      return transition_node;
+    }
+    if (node == kRootNode) {
+      return kRootNode;
+    }
+    node = nodes[node].suffix_link;
+  }
+}
 
-class AutomatonGraph {
+// Finds the first byte of a range which belongs to a set. On x86 the AVX2
+// or SSSE3 kernel, whichever the CPU supports, classifies 32 or 16 bytes
+// at once by two lookups of their nibbles, which let through bytes whose
+// high nibbles differ by 8 from some byte of the set, so candidates are
+// verified by the exact table. The kernels are compiled for their targets
+// whatever the build flags are, and the scalar loop is the fallback
+class ByteSetSearcher {
  public:
-  struct Edge {
-    Edge(AutomatonNode *source, AutomatonNode * target, char character)
-        : source(source), target(target), character(character) {}
-
-    AutomatonNode * source;
-    AutomatonNode * target;
-    char character;
-  };
-};
-
-std::vector<typename AutomatonGraph::Edge> OutgoingEdges(
-    const AutomatonGraph & /*graph*/, AutomatonNode * vertex) {
-  std::vector<typename AutomatonGraph::Edge> outgoing_edges;
-
-  for (auto &target_transition : vertex->trie_transitions) {
-    AutomatonNode * target = &(target_transition.second);
-    char character = target_transition.first;
-    outgoing_edges.emplace_back(vertex, target, character);
+  ByteSetSearcher() : kernel_(SupportedKernel()) {
+    std::fill(std::begin(in_set_), std::end(in_set_), false);
+    std::fill(std::begin(low_nibble_masks_), std::end(low_nibble_masks_), 0);
+    for (size_t high_nibble = 0; high_nibble < 16; ++high_nibble) {
+      high_nibble_masks_[high_nibble] = 1 << (high_nibble % 8);
+    }
   }
 
-  return outgoing_edges;
-}
+  void Add(unsigned char byte) {
+    in_set_[byte] = true;
+    low_nibble_masks_[byte & 0xF] |= high_nibble_masks_[byte >> 4];
+  }
 
-AutomatonNode * GetTarget(const AutomatonGraph & /*graph*/,
-                         const AutomatonGraph::Edge &edge) {
-  return edge.target;
-}
+  const char * Find(const char * begin, const char * end) const {
+    const char * position = begin;
+#if defined(__x86_64__) || defined(__i386__)
+    if (kernel_ == Kernel::kAvx2) {
+      position = FindAvx2(position, end);
+    } else if (kernel_ == Kernel::kSsse3) {
+      position = FindSsse3(position, end);
+    }
+#endif
+    while (position != end && !in_set_[static_cast<unsigned char>(*position)]) {
+      ++position;
+    }
+    return position;
+  }
 
-class SuffixLinkCalculator
-    : public traverses::BFSVisitor<AutomatonNode *, AutomatonGraph::Edge> {
- public:
-  explicit SuffixLinkCalculator(AutomatonNode * root) : root_(root) {}
+ private:
+  enum class Kernel { kScalar, kSsse3, kAvx2 };
+
+  // The CPU is asked once per process
+  static Kernel SupportedKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const Kernel kKernel = []() -> Kernel {
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) {
+        return Kernel::kAvx2;
+      }
+      return __builtin_cpu_supports("ssse3") ? Kernel::kSsse3 : Kernel::kScalar;
+    }();
+    return kKernel;
+#else
+    return Kernel::kScalar;
+#endif
+  }
 
-  void ExamineVertex(AutomatonNode * node) override {
-    if (node == root_) {
-      node->suffix_link = root_;
+#if defined(__x86_64__) || defined(__i386__)
+  // The kernels return the first byte of the set in whole blocks or, if
+  // there is none, the start of the tail shorter than a block
+  __attribute__((target("avx2")))
+  const char * FindAvx2(const char * position, const char * end) const {
+    const __m256i low_nibble_masks = _mm256_broadcastsi128_si256(
+        _mm_load_si128(reinterpret_cast<const __m128i *>(low_nibble_masks_)));
+    const __m256i high_nibble_masks = _mm256_broadcastsi128_si256(
+        _mm_load_si128(reinterpret_cast<const __m128i *>(high_nibble_masks_)));
+    const __m256i nibble = _mm256_set1_epi8(0xF);
+
+    for (; end - position >= 32; position += 32) {
+      __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(position));
+      __m256i candidates = _mm256_and_si256(
+          _mm256_shuffle_epi8(low_nibble_masks, _mm256_and_si256(bytes, nibble)),
+          _mm256_shuffle_epi8(high_nibble_masks,
+                              _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble)));
+      uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(
+          _mm256_cmpeq_epi8(candidates, _mm256_setzero_si256())));
+      if (const char * found = FirstInSet(position, mask)) {
+        return found;
+      }
     }
+    return position;
   }
 
-  void ExamineEdge(const AutomatonGraph::Edge &edge) override {
-    if (edge.source == root_) {
-      edge.target->suffix_link = root_;
-      return;
+  __attribute__((target("ssse3")))
+  const char * FindSsse3(const char * position, const char * end) const {
+    const __m128i low_nibble_masks =
+        _mm_load_si128(reinterpret_cast<const __m128i *>(low_nibble_masks_));
+    const __m128i high_nibble_masks =
+        _mm_load_si128(reinterpret_cast<const __m128i *>(high_nibble_masks_));
+    const __m128i nibble = _mm_set1_epi8(0xF);
+
+    for (; end - position >= 16; position += 16) {
+      __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(position));
+      __m128i candidates = _mm_and_si128(
+          _mm_shuffle_epi8(low_nibble_masks, _mm_and_si128(bytes, nibble)),
+          _mm_shuffle_epi8(high_nibble_masks,
+                           _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble)));
+      uint32_t mask = ~static_cast<uint32_t>(_mm_movemask_epi8(
+          _mm_cmpeq_epi8(candidates, _mm_setzero_si128()))) & 0xFFFF;
+      if (const char * found = FirstInSet(position, mask)) {
+        return found;
+      }
+    }
+    return position;
+  }
+#endif
+
+  // Bit i of the mask marks a candidate at block + i
+  const char * FirstInSet(const char * block, uint32_t mask) const {
+    while (mask != 0) {
+      const char * candidate = block + __builtin_ctz(mask);
+      if (in_set_[static_cast<unsigned char>(*candidate)]) {
+        return candidate;
+      }
+      mask &= mask - 1;
     }
-    
-    edge.target->suffix_link = 
-              GetAutomatonTransition(edge.source->suffix_link, root_, edge.character);
+    return nullptr;
   }
 
- private:
-  AutomatonNode * root_;
+  Kernel kernel_;
+  bool in_set_[256];
+  alignas(16) uint8_t low_nibble_masks_[16];
+  alignas(16) uint8_t high_nibble_masks_[16];
 };
 
-class TerminalLinkCalculator
-    : public traverses::BFSVisitor<AutomatonNode *, AutomatonGraph::Edge> {
+class NodeReference;
+class AutomatonBuilder;
+
+class Automaton {
  public:
-  explicit TerminalLinkCalculator(AutomatonNode * root) : root_(root) {}
+  Automaton() : mode_(TransitionsMode::kSparse) {}
 
-  void DiscoverVertex(AutomatonNode * node) override {
-    if (node == root_) {
-      node->terminal_link = nullptr;
-      return;
-    }
+  Automaton(const Automaton &) = delete;
+  Automaton &operator=(const Automaton &) = delete;
 
-    node->terminal_link = node->suffix_link->terminal_link;
+  NodeReference Root() const;
 
-    if (node->suffix_link->terminated_string_ids.size() > 0) {
-      node->terminal_link = node->suffix_link;
-    }
+  TransitionsMode Mode() const { return mode_; }
+
+  size_t NodesNumber() const { return nodes_.size(); }
+
+  // Returns the first character of a range on which the root goes to
+  // another node, or the end. Scanning the characters before it from the
+  // root leaves the automaton in the root, and if no empty word was added
+  // generates no matches
+  const char * FindRootExit(const char * begin, const char * end) const {
+    return root_exits_.Find(begin, end);
+  }
+
+  // Bytes held by the arrays of the automaton
+  size_t MemoryUsage() const {
+    return nodes_.size() * sizeof(AutomatonNode) +
+           terminated_string_ids_.size() * sizeof(size_t) +
+           goto_table_.size() * sizeof(uint32_t) +
+           double_array_cells_.size() * sizeof(uint32_t);
   }
 
  private:
-  AutomatonNode * root_;
-};
+  uint32_t Transition(uint32_t node, char character) const {
+    switch (mode_) {
+      case TransitionsMode::kDense:
+        return goto_table_[node * kGotoRowSize + static_cast<unsigned char>(character)];
+      case TransitionsMode::kDoubleArray:
+        while (true) {
+          uint32_t transition_node = DoubleArrayTransition(node, character);
+          if (transition_node != kNoNode) {
+            return transition_node;
+          }
+          if (node == kRootNode) {
+            return kRootNode;
+          }
+          node = nodes_[node].suffix_link;
+        }
+      default:
+        return GetAutomatonTransition(nodes_.data(), node, character);
+    }
+  }
 
-}  // namespace internal
+  // Children of a node are put at base xor character, so the cells of a
+  // node stay in one block of kGotoRowSize cells. A cell belongs to
+  // the node if it holds one of its children, as children ranges of
+  // different nodes never intersect, and the child of the cell then has
+  // exactly this character
+  uint32_t DoubleArrayTransition(uint32_t node, char character) const {
+    uint32_t child = double_array_cells_[nodes_[node].double_array_base ^
+                                         static_cast<unsigned char>(character)];
+    return child - nodes_[node].first_child < nodes_[node].children_number ? child
+                                                                          : kNoNode;
+  }
 
+  TransitionsMode mode_;
+  // First characters of the words
+  ByteSetSearcher root_exits_;
+  std::vector<AutomatonNode> nodes_;
+  std::vector<size_t> terminated_string_ids_;
+  // Filled in TransitionsMode::kDense only
+  std::vector<uint32_t> goto_table_;
+  // Filled in TransitionsMode::kDoubleArray only
+  std::vector<uint32_t> double_array_cells_;
+
+  friend class NodeReference;
+  friend class AutomatonBuilder;
+};
 
 class NodeReference {
  public:
-  NodeReference() : node_(nullptr), root_(nullptr) {}
+  NodeReference() : node_(kNoNode), automaton_(nullptr) {}
 
-  NodeReference(AutomatonNode * node, AutomatonNode * root)
-      : node_(node), root_(root) {}
+  NodeReference(uint32_t node, const Automaton * automaton)
+      : node_(node), automaton_(automaton) {}
 
   NodeReference Next(char character) const {
-    return NodeReference(GetAutomatonTransition(node_, root_, character), root_);
+    return {automaton_->Transition(node_, character), automaton_};
   }
 
   template <class Callback>
@@ -218,50 +354,43 @@ class NodeReference {
   }
 
   bool IsTerminal() const {
-    return (node_->terminated_string_ids.size() > 0 && node_->terminal_link != nullptr);
+    return (Node().terminated_string_ids_number > 0 &&
+            Node().terminal_link != kNoNode);
   }
 
-  explicit operator bool() const { return node_ != nullptr; }
+  bool IsRoot() const { return node_ == kRootNode; }
+
+  explicit operator bool() const { return node_ != kNoNode; }
 
   bool operator==(NodeReference other) const {
-    return node_ == other.node_ && root_ == other.root_;
+    return node_ == other.node_ && automaton_ == other.automaton_;
   }
 
  private:
-  typedef std::vector<size_t>::const_iterator TerminatedStringIterator;
+  typedef const size_t * TerminatedStringIterator;
   typedef IteratorRange<TerminatedStringIterator> TerminatedStringIteratorRange;
 
-  NodeReference TerminalLink() const {
-    return {node_->terminal_link, root_};
+  const AutomatonNode &Node() const {
+    return automaton_->nodes_[node_];
   }
 
-  TerminatedStringIteratorRange TerminatedStringIds() const {
-    return {node_->terminated_string_ids.begin(), node_->terminated_string_ids.end()};
+  NodeReference TerminalLink() const {
+    return {Node().terminal_link, automaton_};
   }
 
-  AutomatonNode * node_;
-  AutomatonNode * root_;
-};
-
-class AutomatonBuilder;
-
-class Automaton {
- public:
-  Automaton() = default;
-
-  Automaton(const Automaton &) = delete;
-  Automaton &operator=(const Automaton &) = delete;
-
-  NodeReference Root() {
-    return NodeReference(&root_, &root_);
+  TerminatedStringIteratorRange TerminatedStringIds() const {
+    const size_t * begin =
+        automaton_->terminated_string_ids_.data() + Node().first_terminated_string_id;
+    return {begin, begin + Node().terminated_string_ids_number};
   }
 
- private:
-  AutomatonNode root_;
-
-  friend class AutomatonBuilder;
+  uint32_t node_;
+  const Automaton * automaton_;
 };
 
+inline NodeReference Automaton::Root() const {
+  return NodeReference(kRootNode, this);
+}
 class AutomatonBuilder {
  public:
   void Add(const std::string &string, size_t id) {
@@ -269,51 +398,476 @@ class AutomatonBuilder {
     ids_.push_back(id);
   }
 
-  std::unique_ptr<Automaton> Build() {
+  // The dense goto table takes a single load per scanned character but
+  // costs 1 KiB per trie node, so it suits small and medium dictionaries
+  std::unique_ptr<Automaton> Build(TransitionsMode mode = TransitionsMode::kSparse) {
     auto automaton = make_unique<Automaton>();
     BuildTrie(words_, ids_, automaton.get());
-    BuildSuffixLinks(automaton.get());
-    BuildTerminalLinks(automaton.get());
+    BuildLinks(mode == TransitionsMode::kDense, automaton.get());
+    if (mode == TransitionsMode::kDoubleArray) {
+      BuildDoubleArray(automaton.get());
+    }
     return automaton;
   }
 
  private:
+  // Words which pass through a node are a range of the sorted words
+  struct WordsRange {
+    uint32_t begin;
+    uint32_t end;
+    uint32_t depth;
+  };
+
+  // Lays the trie out level by level: the words of a node are split by
+  // their next character into the ranges of its children, which are
+  // appended to the array behind all nodes discovered before
   static void BuildTrie(const std::vector<std::string> &words,
                         const std::vector<size_t> &ids, Automaton * automaton) {
-    for (size_t word_index = 0; word_index < words.size(); ++word_index) {
-      AddString(&automaton->root_, ids[word_index], words[word_index]);
+    if (words.size() >= kNoNode) {
+      throw std::length_error("too many words for the automaton");
     }
-  }
 
-  static void AddString(AutomatonNode * root, size_t string_id,
-                        const std::string &string) {
-    AutomatonNode * adding_node = root;
-    
-    for (const char character : string) {
-      adding_node = &adding_node->trie_transitions[character];
+    std::vector<uint32_t> order(words.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&words](uint32_t first, uint32_t second) {
+                       return words[first] < words[second];
+                     });
+
+    std::vector<AutomatonNode> &nodes = automaton->nodes_;
+    std::vector<WordsRange> words_ranges(1, {0, static_cast<uint32_t>(words.size()), 0});
+    nodes.assign(1, AutomatonNode());
+    automaton->root_exits_ = ByteSetSearcher();
+
+    for (uint32_t node = 0; node < nodes.size(); ++node) {
+      const WordsRange range = words_ranges[node];
+      uint32_t word = range.begin;
+
+      nodes[node].first_terminated_string_id = automaton->terminated_string_ids_.size();
+      for (; word < range.end && words[order[word]].size() == range.depth; ++word) {
+        automaton->terminated_string_ids_.push_back(ids[order[word]]);
+      }
+      nodes[node].terminated_string_ids_number =
+          automaton->terminated_string_ids_.size() -
+          nodes[node].first_terminated_string_id;
+
+      nodes[node].first_child = nodes.size();
+      while (word < range.end) {
+        const char character = words[order[word]][range.depth];
+        uint32_t group_end = word + 1;
+        while (group_end < range.end &&
+               words[order[group_end]][range.depth] == character) {
+          ++group_end;
+        }
+
+        if (nodes.size() == kNoNode) {
+          throw std::length_error("too many nodes for the automaton");
+        }
+        nodes.emplace_back();
+        nodes.back().character = character;
+        if (node == kRootNode) {
+          automaton->root_exits_.Add(character);
+        }
+        words_ranges.push_back({word, group_end, range.depth + 1});
+        word = group_end;
+      }
+      nodes[node].children_number = nodes.size() - nodes[node].first_child;
     }
-    
-    adding_node->terminated_string_ids.push_back(string_id);
   }
 
-  static void BuildSuffixLinks(Automaton * automaton) {
-    internal::SuffixLinkCalculator suffix_links_calculator(&automaton->root_);
-    
-    traverses::BreadthFirstSearch(&automaton->root_, internal::AutomatonGraph(),
-                                  suffix_links_calculator);
+  // Nodes are stored in breadth-first order, so one pass over the array
+  // reaches a node after all shallower nodes, whose links are then set.
+  // Passing a node sets the suffix and terminal links of its children;
+  // with the goto table the row of the node is first copied from the row
+  // of its suffix link, which is shorter and therefore complete, and the
+  // suffix link of a child is a single lookup in it
+  static void BuildLinks(bool build_goto_table, Automaton * automaton) {
+    std::vector<AutomatonNode> &nodes = automaton->nodes_;
+    std::vector<uint32_t> &goto_table = automaton->goto_table_;
+    if (build_goto_table) {
+      automaton->mode_ = TransitionsMode::kDense;
+      goto_table.assign(nodes.size() * kGotoRowSize, kRootNode);
+    }
+    nodes[kRootNode].suffix_link = kRootNode;
+    nodes[kRootNode].terminal_link = kNoNode;
+
+    for (uint32_t node = 0; node < nodes.size(); ++node) {
+      const uint32_t node_suffix_link = nodes[node].suffix_link;
+      uint32_t * row = build_goto_table ? goto_table.data() + node * kGotoRowSize : nullptr;
+      const uint32_t * link_row =
+          build_goto_table ? goto_table.data() + node_suffix_link * kGotoRowSize : nullptr;
+      if (build_goto_table && node != kRootNode) {
+        std::copy(link_row, link_row + kGotoRowSize, row);
+      }
+
+      const uint32_t children_end = nodes[node].first_child + nodes[node].children_number;
+      for (uint32_t child = nodes[node].first_child; child < children_end; ++child) {
+        const char character = nodes[child].character;
+        uint32_t suffix_link = kRootNode;
+        if (node != kRootNode) {
+          suffix_link = build_goto_table
+              ? link_row[static_cast<unsigned char>(character)]
+              : GetAutomatonTransition(nodes.data(), node_suffix_link, character);
+        }
+
+        const AutomatonNode &suffix_link_node = nodes[suffix_link];
+        nodes[child].suffix_link = suffix_link;
+        nodes[child].terminal_link = suffix_link_node.terminated_string_ids_number > 0
+            ? suffix_link
+            : suffix_link_node.terminal_link;
+        if (build_goto_table) {
+          row[static_cast<unsigned char>(character)] = child;
+        }
+      }
+    }
   }
 
-  static void BuildTerminalLinks(Automaton * automaton) {
-    internal::TerminalLinkCalculator terminal_links_calculator(&automaton->root_);
-    
-    traverses::BreadthFirstSearch(&automaton->root_, internal::AutomatonGraph(),
-                                  terminal_links_calculator);
+  // Places the children of every node at the first base where all their
+  // cells are free. A single child takes the first free cell. Wider nodes
+  // probe the last kMaxProbedCells cells and otherwise open a new block.
+  // Most nodes of a large dictionary have a single child, so they fill the
+  // holes left by wide nodes
+  static void BuildDoubleArray(Automaton * automaton) {
+    std::vector<AutomatonNode> &nodes = automaton->nodes_;
+    std::vector<uint32_t> &cells = automaton->double_array_cells_;
+    automaton->mode_ = TransitionsMode::kDoubleArray;
+    cells.assign(kGotoRowSize, kNoNode);
+    size_t first_free_cell = 0;
+
+    for (uint32_t node = 0; node < nodes.size(); ++node) {
+      const uint32_t first_child = nodes[node].first_child;
+      const uint32_t children_end = first_child + nodes[node].children_number;
+      if (first_child == children_end) {
+        continue;
+      }
+
+      const unsigned char first_character = nodes[first_child].character;
+      while (first_free_cell < cells.size() && cells[first_free_cell] != kNoNode) {
+        ++first_free_cell;
+      }
+
+      size_t node_base = cells.size();
+      size_t first_cell = first_free_cell;
+      if (nodes[node].children_number > 1 && cells.size() > kMaxProbedCells) {
+        first_cell = std::max(first_cell, cells.size() - kMaxProbedCells);
+      }
+      for (size_t cell = first_cell; cell < cells.size(); ++cell) {
+        if (cells[cell] != kNoNode) {
+          continue;
+        }
+        uint32_t child = first_child + 1;
+        while (child < children_end &&
+               cells[(cell ^ first_character) ^
+                     static_cast<unsigned char>(nodes[child].character)] == kNoNode) {
+          ++child;
+        }
+        if (child == children_end) {
+          node_base = cell ^ first_character;
+          break;
+        }
+      }
+
+      if (node_base == cells.size()) {
+        if (cells.size() + kGotoRowSize > kNoNode) {
+          throw std::length_error("too many nodes for the double array");
+        }
+        cells.resize(cells.size() + kGotoRowSize, kNoNode);
+      }
+      nodes[node].double_array_base = node_base;
+      for (uint32_t child = first_child; child < children_end; ++child) {
+        cells[node_base ^ static_cast<unsigned char>(nodes[child].character)] = child;
+      }
+    }
+    cells.shrink_to_fit();
   }
 
+  static constexpr size_t kMaxProbedCells = 1024;
+
   std::vector<std::string> words_;
   std::vector<size_t> ids_;
 };
 
+// Keeps a dictionary which changes while texts are scanned. Words live in
+// a logarithmic set of static automata, oldest level first, and once the
+// merges catch up every level is more than twice as large as the next.
+// An update is folded into the newest level while it is small, and
+// otherwise starts a new level, and a background thread merges adjacent
+// levels which break the order, so an update never waits for a large
+// rebuild. A removal is a tombstone which
+// hides the words of its id in the older levels, and merging into the
+// oldest level drops both. Scans run over an immutable snapshot, which
+// updates and merges replace as a whole
+class DynamicDictionary {
+ public:
+  struct Level {
+    Level() : has_empty_word(false) {}
+
+    size_t Size() const { return words.size() + removed_ids.size(); }
+
+    std::vector<std::string> words;
+    std::vector<size_t> ids;
+    // Ids whose words are hidden in the older levels
+    std::unordered_set<size_t> removed_ids;
+    std::unique_ptr<Automaton> automaton;
+    bool has_empty_word;
+  };
+
+  class Snapshot {
+   public:
+    // Calls on_match(id, offset) with the offset in the range of the last
+    // character of every occurrence of a live word. Levels are scanned one
+    // after another, so occurrences are not ordered by offset
+    template <class Callback>
+    void Scan(const char * begin, const char * end, Callback on_match) const {
+      for (size_t level = 0; level < levels_.size(); ++level) {
+        const Automaton &automaton = *levels_[level]->automaton;
+        NodeReference state = automaton.Root();
+        const char * position = begin;
+        while (position != end) {
+          if (state.IsRoot() && !levels_[level]->has_empty_word) {
+            position = automaton.FindRootExit(position, end);
+            if (position == end) {
+              break;
+            }
+          }
+
+          state = state.Next(*position);
+          state.GenerateMatches([this, &on_match, level, begin, position](size_t id) {
+            if (!IsRemoved(level, id)) {
+              on_match(id, position - begin);
+            }
+          });
+          ++position;
+        }
+      }
+    }
+
+    size_t LevelsNumber() const { return levels_.size(); }
+
+   private:
+    friend class DynamicDictionary;
+
+    bool IsRemoved(size_t level, size_t id) const {
+      for (size_t newer_level = level + 1; newer_level < levels_.size(); ++newer_level) {
+        if (levels_[newer_level]->removed_ids.count(id) > 0) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    std::vector<std::shared_ptr<const Level>> levels_;
+  };
+
+  DynamicDictionary()
+      : snapshot_(std::make_shared<Snapshot>()),
+        is_merging_(false),
+        merged_level_(0),
+        stopped_(false),
+        merger_([this] { MergeLevels(); }) {}
+
+  DynamicDictionary(const DynamicDictionary &) = delete;
+  DynamicDictionary &operator=(const DynamicDictionary &) = delete;
+
+  ~DynamicDictionary() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    changed_.notify_all();
+    merger_.join();
+  }
+
+  void Insert(const std::string &word, size_t id) {
+    Level change;
+    change.words.push_back(word);
+    change.ids.push_back(id);
+    Update(std::move(change));
+  }
+
+  // A batch, such as a whole list loaded at once, becomes a single level
+  void Insert(const std::vector<std::string> &words, const std::vector<size_t> &ids) {
+    if (words.size() != ids.size()) {
+      throw std::invalid_argument("every word needs an id");
+    }
+
+    Level change;
+    change.words = words;
+    change.ids = ids;
+    Update(std::move(change));
+  }
+
+  // Hides every word inserted with the id before
+  void Remove(size_t id) {
+    Level change;
+    change.removed_ids.insert(id);
+    Update(std::move(change));
+  }
+
+  // The snapshot stays valid and unchanged however long it is held
+  std::shared_ptr<const Snapshot> CurrentSnapshot() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return snapshot_;
+  }
+
+  // Blocks until the background thread has no levels left to merge
+  void WaitForMerges() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t level = 0;
+    changed_.wait(lock, [this, &level] { return !FindMergedLevels(*snapshot_, &level); });
+  }
+
+ private:
+  // Small levels get the dense goto table, which has at most
+  // kMaxDenseLevelLength + 1 trie nodes of 1 KiB each
+  static constexpr size_t kMaxDenseLevelLength = 1 << 10;
+  // Size of the newest level up to which updates are folded into it
+  static constexpr size_t kMaxFoldedLevelSize = 1 << 6;
+
+  static void BuildAutomaton(Level * level) {
+    AutomatonBuilder automaton_builder;
+    size_t total_length = 0;
+    for (size_t word = 0; word < level->words.size(); ++word) {
+      automaton_builder.Add(level->words[word], level->ids[word]);
+      total_length += level->words[word].size();
+      level->has_empty_word |= level->words[word].empty();
+    }
+    level->automaton = automaton_builder.Build(
+        total_length <= kMaxDenseLevelLength ? TransitionsMode::kDense
+                                             : TransitionsMode::kDoubleArray);
+  }
+
+  // Tombstones of the newer level hide words of the older one, and are
+  // kept for the levels before them unless there are none
+  static std::shared_ptr<const Level> Merge(const Level &older_level, const Level &newer_level,
+                                            bool is_oldest) {
+    auto merged_level = std::make_shared<Level>();
+    for (size_t word = 0; word < older_level.words.size(); ++word) {
+      if (newer_level.removed_ids.count(older_level.ids[word]) == 0) {
+        merged_level->words.push_back(older_level.words[word]);
+        merged_level->ids.push_back(older_level.ids[word]);
+      }
+    }
+    merged_level->words.insert(merged_level->words.end(), newer_level.words.begin(),
+                               newer_level.words.end());
+    merged_level->ids.insert(merged_level->ids.end(), newer_level.ids.begin(),
+                             newer_level.ids.end());
+    if (!is_oldest) {
+      merged_level->removed_ids = older_level.removed_ids;
+      merged_level->removed_ids.insert(newer_level.removed_ids.begin(),
+                                       newer_level.removed_ids.end());
+    }
+
+    BuildAutomaton(merged_level.get());
+    return merged_level;
+  }
+
+  // Finds the newest level which is at most twice as large as the next one,
+  // exactly twice as large also breaks the order of the class
+  static bool FindMergedLevels(const Snapshot &snapshot, size_t * level) {
+    for (size_t older_level = snapshot.levels_.size(); older_level-- > 1;) {
+      if (snapshot.levels_[older_level - 1]->Size() <= 2 * snapshot.levels_[older_level]->Size()) {
+        *level = older_level - 1;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool IsMerged(size_t level) const {
+    return is_merging_ && (level == merged_level_ || level == merged_level_ + 1);
+  }
+
+  // Updates are applied one at a time. The newest level can only be
+  // replaced by the merger meanwhile, which the check of its pointer
+  // under the lock catches
+  void Update(Level change) {
+    std::lock_guard<std::mutex> update_lock(update_mutex_);
+    std::shared_ptr<const Level> newest_level;
+    bool is_oldest = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const size_t levels_number = snapshot_->levels_.size();
+      if (levels_number > 0 && !IsMerged(levels_number - 1) &&
+          snapshot_->levels_.back()->Size() + change.Size() <= kMaxFoldedLevelSize) {
+        newest_level = snapshot_->levels_.back();
+        is_oldest = levels_number == 1;
+      }
+    }
+
+    if (newest_level) {
+      std::shared_ptr<const Level> folded_level = Merge(*newest_level, change, is_oldest);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const size_t levels_number = snapshot_->levels_.size();
+        if (snapshot_->levels_.back() == newest_level && !IsMerged(levels_number - 1)) {
+          auto snapshot = std::make_shared<Snapshot>(*snapshot_);
+          snapshot->levels_.back() = std::move(folded_level);
+          snapshot_ = std::move(snapshot);
+          newest_level.reset();
+        }
+      }
+      if (!newest_level) {
+        changed_.notify_all();
+        return;
+      }
+    }
+
+    auto level = std::make_shared<Level>(std::move(change));
+    BuildAutomaton(level.get());
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto snapshot = std::make_shared<Snapshot>(*snapshot_);
+      snapshot->levels_.push_back(std::move(level));
+      snapshot_ = std::move(snapshot);
+    }
+    changed_.notify_all();
+  }
+
+  // Runs on merger_. A pair of levels is merged without the lock, and as
+  // updates only append levels or replace the newest one when it is not
+  // merged, the pair keeps its place in the snapshot which is current
+  // when the merged level replaces it
+  void MergeLevels() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      size_t level = 0;
+      changed_.wait(lock, [this, &level] {
+        return stopped_ || FindMergedLevels(*snapshot_, &level);
+      });
+      if (stopped_) {
+        return;
+      }
+
+      const std::shared_ptr<const Level> older_level = snapshot_->levels_[level];
+      const std::shared_ptr<const Level> newer_level = snapshot_->levels_[level + 1];
+      is_merging_ = true;
+      merged_level_ = level;
+      lock.unlock();
+      std::shared_ptr<const Level> merged_level = Merge(*older_level, *newer_level, level == 0);
+      lock.lock();
+
+      auto snapshot = std::make_shared<Snapshot>(*snapshot_);
+      snapshot->levels_[level] = std::move(merged_level);
+      snapshot->levels_.erase(snapshot->levels_.begin() + level + 1);
+      snapshot_ = std::move(snapshot);
+      is_merging_ = false;
+      changed_.notify_all();
+    }
+  }
+
+  mutable std::mutex mutex_;
+  mutable std::condition_variable changed_;
+  std::shared_ptr<const Snapshot> snapshot_;
+  // Levels merged_level_ and merged_level_ + 1 are being merged
+  bool is_merging_;
+  size_t merged_level_;
+  bool stopped_;
+  std::mutex update_mutex_;
+  // Started last, when the other members are ready
+  std::thread merger_;
+};
+
 }  // namespace aho_corasick
 
 // Consecutive delimiters are not grouped together and are deemed
@@ -342,100 +896,1110 @@ std::vector<std::string> Split(const std::string &string, Predicate is_delimiter
   return strings_splitted;
 }
 
-class WildcardMatcher {
+// In-place iterative radix-2 transform of a fixed power of two size
+class FourierTransform {
  public:
-  WildcardMatcher() : number_of_words_(0), pattern_length_(0) {}
+  FourierTransform() = default;
 
-  void Init(const std::string &pattern, char wildcard) {
-    auto pattern_splitted = Split(pattern, [wildcard](char symbol) { 
-                                             return symbol == wildcard; 
-                                           });
+  explicit FourierTransform(size_t size) : roots_(size / 2), reversed_(size) {
+    const double kPi = std::acos(-1.0);
+    for (size_t index = 0; index < roots_.size(); ++index) {
+      roots_[index] = std::polar(1.0, 2 * kPi * index / size);
+    }
 
-    aho_corasick::AutomatonBuilder automaton_builder;
+    size_t bits = 0;
+    while ((size_t(1) << bits) < size) {
+      ++bits;
+    }
+    for (size_t index = 0; index < size; ++index) {
+      reversed_[index] = bits == 0 ? 0 : (reversed_[index >> 1] >> 1) |
+                                             ((index & 1) << (bits - 1));
+    }
+  }
 
-    size_t right_end_position = 0;
-    for (const auto &subpattern : pattern_splitted) {
-        right_end_position += subpattern.size() + 1;
-        ++number_of_words_;
-        automaton_builder.Add(subpattern, right_end_position);
+  size_t Size() const { return reversed_.size(); }
+
+  // The inverse transform is not divided by the size
+  void Transform(std::vector<std::complex<double>> * values, bool inverse) const {
+    std::vector<std::complex<double>> &data = *values;
+    const size_t size = Size();
+    for (size_t index = 0; index < size; ++index) {
+      if (index < reversed_[index]) {
+        std::swap(data[index], data[reversed_[index]]);
+      }
+    }
+
+    for (size_t half = 1; half < size; half *= 2) {
+      const size_t root_step = size / (2 * half);
+      for (size_t block = 0; block < size; block += 2 * half) {
+        for (size_t offset = 0; offset < half; ++offset) {
+          std::complex<double> root = roots_[offset * root_step];
+          if (inverse) {
+            root = std::conj(root);
+          }
+          const std::complex<double> odd = data[block + half + offset] * root;
+          data[block + half + offset] = data[block + offset] - odd;
+          data[block + offset] += odd;
+        }
+      }
     }
+  }
+
+ private:
+  std::vector<std::complex<double>> roots_;
+  std::vector<size_t> reversed_;
+};
+
+// Finds matches of a pattern with wildcards by convolutions. Characters of
+// the pattern p and of the text t are coded by positive numbers and
+// wildcards by zero, so a window matches if and only if
+//   sum p (p - t)^2 = sum p^3 - 2 sum p^2 t + sum p t^2
+// is zero. The text is cut into blocks of the transform size overlapping
+// by |P| - 1, so scanning takes O(|T| log |P|) time whatever the number of
+// wildcards is. Both sums over the text come from one complex transform
+// of t + i t^2. Matches ending in a range are reported by the end of its
+// Scan, so short ranges cost a whole block transform each
+class FourierWildcardMatcher {
+ public:
+  FourierWildcardMatcher()
+      : pattern_length_(0),
+        pattern_cubes_sum_(0),
+        block_position_(0),
+        block_size_(0),
+        reported_windows_number_(0) {}
 
-    aho_corasick_automaton_ = automaton_builder.Build();
+  void Init(const std::string &pattern, char wildcard) {
     pattern_length_ = pattern.size();
+    std::fill(std::begin(codes_), std::end(codes_), 0);
+    double alphabet_size = 0;
+    for (const char character : pattern) {
+      if (character != wildcard && codes_[static_cast<unsigned char>(character)] == 0) {
+        codes_[static_cast<unsigned char>(character)] = ++alphabet_size;
+      }
+    }
+    for (auto &code : codes_) {
+      if (code == 0) {
+        code = alphabet_size + 1;
+      }
+    }
+
+    size_t transform_size = kMinTransformSize;
+    while (transform_size < 4 * pattern_length_) {
+      transform_size *= 2;
+    }
+    transform_ = FourierTransform(transform_size);
+
+    // Reversed pattern turns the convolution into the sliding sum
+    std::vector<std::complex<double>> pattern_values(transform_size);
+    std::vector<std::complex<double>> pattern_squares(transform_size);
+    pattern_cubes_sum_ = 0;
+    for (size_t offset = 0; offset < pattern_length_; ++offset) {
+      const char character = pattern[pattern_length_ - 1 - offset];
+      const double code =
+          character == wildcard ? 0 : codes_[static_cast<unsigned char>(character)];
+      pattern_values[offset] = code;
+      pattern_squares[offset] = code * code;
+      pattern_cubes_sum_ += code * code * code;
+    }
+    transform_.Transform(&pattern_values, false);
+    transform_.Transform(&pattern_squares, false);
+    pattern_values_spectrum_.swap(pattern_values);
+    pattern_squares_spectrum_.swap(pattern_squares);
+
+    block_.assign(transform_size, 0);
+    spectrum_.assign(transform_size, 0);
     Reset();
   }
 
   // Resets matcher to start scanning new stream
-  // updatewordoccurrences here handles first empty subpattern, if exists
   void Reset() {
-    state_ = aho_corasick_automaton_->Root();
-    words_occurrences_by_position_.assign(pattern_length_ + 1, 0);
-    UpdateWordOccurrences();
+    block_position_ = 0;
+    block_size_ = 0;
+    reported_windows_number_ = 0;
+  }
+
+  // Characters of a block, ranges at least this long take O(log |P|) time
+  // per character
+  size_t BlockSize() const { return block_.size(); }
+
+  size_t ScannedNumber() const { return block_position_ + block_size_; }
+
+  // The last min(|P| - 1, ScannedNumber()) characters, which the windows
+  // still unreported start with
+  std::string RecentText() const {
+    const size_t recent_size =
+        std::min(block_size_, pattern_length_ == 0 ? 0 : pattern_length_ - 1);
+    return std::string(block_.begin() + block_size_ - recent_size,
+                       block_.begin() + block_size_);
   }
 
+  // Scans characters of a range and calls on_match with the offset in the
+  // range of the last character of every match
   template <class Callback>
-  void Scan(char character, Callback on_match) {
-    if (!state_) {
+  void Scan(const char * begin, const char * end, Callback on_match) {
+    if (transform_.Size() == 0) {
       throw std::runtime_error("mather wasn't initialized");
     }
 
-    state_ = state_.Next(character);
-    ShiftWordOccurrencesCounters();
-    UpdateWordOccurrences();
-
-    if (words_occurrences_by_position_.front() == number_of_words_) {
-       on_match();
+    const size_t range_position = block_position_ + block_size_;
+    const char * position = begin;
+    while (position != end) {
+      const size_t taken_size =
+          std::min<size_t>(end - position, block_.size() - block_size_);
+      std::copy(position, position + taken_size, block_.begin() + block_size_);
+      block_size_ += taken_size;
+      position += taken_size;
+
+      ReportBlockMatches([&on_match, range_position](size_t last_character_position) {
+        on_match(last_character_position - range_position);
+      });
+      if (block_size_ == block_.size()) {
+        NextBlock();
+      }
     }
   }
- 
+
  private:
-  void UpdateWordOccurrences() {
-    auto &words_occurrences_by_position_lmb = this->words_occurrences_by_position_;
+  static constexpr size_t kMinTransformSize = 1 << 12;
 
-    state_.GenerateMatches([&words_occurrences_by_position_lmb](size_t position) {
-      ++(words_occurrences_by_position_lmb[(words_occurrences_by_position_lmb.size() - position)]);
-    });
+  // Reports windows of the block which were not reported yet, with the
+  // text positions of their last characters
+  template <class Callback>
+  void ReportBlockMatches(Callback on_match) {
+    if (block_size_ < pattern_length_) {
+      return;
+    }
+    const size_t windows_number = block_size_ - pattern_length_ + 1;
+    if (windows_number <= reported_windows_number_) {
+      return;
+    }
+
+    const size_t size = transform_.Size();
+    for (size_t index = 0; index < size; ++index) {
+      const double code =
+          index < block_size_ ? codes_[static_cast<unsigned char>(block_[index])] : 0;
+      spectrum_[index] = std::complex<double>(code, code * code);
+    }
+    transform_.Transform(&spectrum_, false);
+
+    // Splits spectra of t and t^2 by the symmetry of real sequences and
+    // combines the sums: -2 T P2 + T2 P
+    std::vector<std::complex<double>> &product = spectrum_;
+    for (size_t index = 0; index <= size / 2; ++index) {
+      const size_t mirror = (size - index) % size;
+      const std::complex<double> first = spectrum_[index];
+      const std::complex<double> second = std::conj(spectrum_[mirror]);
+      const std::complex<double> text = (first + second) * 0.5;
+      const std::complex<double> text_squares =
+          (first - second) * std::complex<double>(0, -0.5);
+      const std::complex<double> mirror_text = std::conj(text);
+      const std::complex<double> mirror_text_squares = std::conj(text_squares);
+
+      product[index] = -2.0 * text * pattern_squares_spectrum_[index] +
+                       text_squares * pattern_values_spectrum_[index];
+      product[mirror] = -2.0 * mirror_text * pattern_squares_spectrum_[mirror] +
+                        mirror_text_squares * pattern_values_spectrum_[mirror];
+    }
+    transform_.Transform(&product, true);
+
+    for (size_t window = reported_windows_number_; window < windows_number; ++window) {
+      const double sum =
+          pattern_cubes_sum_ + product[window + pattern_length_ - 1].real() / size;
+      if (std::abs(sum) < 0.5) {
+        on_match(block_position_ + window + pattern_length_ - 1);
+      }
+    }
+    reported_windows_number_ = windows_number;
   }
 
-  void ShiftWordOccurrencesCounters() {
-    words_occurrences_by_position_.pop_front();
-    words_occurrences_by_position_.push_back(0);
+  // Keeps the last |P| - 1 characters, which start windows still unreported
+  void NextBlock() {
+    const size_t kept_size = pattern_length_ == 0 ? 0 : pattern_length_ - 1;
+    const size_t shift = block_size_ - kept_size;
+    std::copy(block_.begin() + shift, block_.begin() + block_size_, block_.begin());
+    block_position_ += shift;
+    block_size_ = kept_size;
+    reported_windows_number_ -= std::min(reported_windows_number_, shift);
   }
 
-  // Storing only O(|pattern|) elements allows us
-  // to consume only O(|pattern|) memory for matcher
-  std::deque<size_t> words_occurrences_by_position_;
-  aho_corasick::NodeReference state_;
-  size_t number_of_words_;
   size_t pattern_length_;
-  std::unique_ptr<aho_corasick::Automaton> aho_corasick_automaton_;
+  // Codes of characters, 0 is left for wildcards of the pattern
+  double codes_[256];
+  double pattern_cubes_sum_;
+  FourierTransform transform_;
+  std::vector<std::complex<double>> pattern_values_spectrum_;
+  std::vector<std::complex<double>> pattern_squares_spectrum_;
+  // Text of the block and its text position
+  std::vector<char> block_;
+  size_t block_position_;
+  size_t block_size_;
+  size_t reported_windows_number_;
+  std::vector<std::complex<double>> spectrum_;
 };
 
-std::string ReadString(std::istream &input_stream) {
-  std::string input_string;
-  std::getline(input_stream, input_string);
+// Counters of the windows ending at the next window_size characters, the
+// one ending at the last scanned character at shift 0. They live in a
+// power-of-two ring, whose slots outside of the window are kept zero, so
+// moving to the next character clears a single slot
+template <class Counter>
+class CounterRing {
+ public:
+  CounterRing() : head_(0), mask_(0), window_size_(0) {}
 
-  return input_string;
-}
+  void Assign(size_t window_size) {
+    size_t capacity = 1;
+    while (capacity < window_size) {
+      capacity *= 2;
+    }
+    counters_.assign(capacity, 0);
+    head_ = 0;
+    mask_ = capacity - 1;
+    window_size_ = window_size;
+  }
 
-// Returns positions of the first character of every match
-std::vector<size_t> FindFuzzyMatches(const std::string &pattern_with_wildcards,
-                                     const std::string &text, char wildcard) {
-  WildcardMatcher wildcard_matcher;
+  void Clear() {
+    std::fill(counters_.begin(), counters_.end(), 0);
+    head_ = 0;
+  }
+
+  Counter &operator[](size_t shift) { return counters_[(head_ + shift) & mask_]; }
+
+  Counter operator[](size_t shift) const {
+    return shift < window_size_ ? counters_[(head_ + shift) & mask_] : 0;
+  }
+
+  void Advance(size_t characters_number) {
+    const size_t cleared_number = std::min(characters_number, window_size_);
+    for (size_t shift = 0; shift < cleared_number; ++shift) {
+      (*this)[shift] = 0;
+    }
+    head_ = (head_ + characters_number) & mask_;
+  }
+
+  size_t WindowSize() const { return window_size_; }
+
+ private:
+  std::vector<Counter> counters_;
+  size_t head_;
+  size_t mask_;
+  size_t window_size_;
+};
+
+class WildcardMatcher {
+ public:
+  WildcardMatcher()
+      : number_of_words_(0),
+        pattern_length_(0),
+        scanned_characters_(0),
+        wildcard_(0),
+        fourier_pattern_(false),
+        use_fourier_(false) {}
+
+  // Mostly wildcard patterns with many solid characters vote so often that
+  // the convolution engine is faster, and it is used instead of the
+  // automaton, which is then only built if single characters are scanned
+  void Init(const std::string &pattern, char wildcard) {
+    const size_t wildcards_number = std::count(pattern.begin(), pattern.end(), wildcard);
+    fourier_pattern_ = 2 * wildcards_number >= pattern.size() &&
+                       pattern.size() - wildcards_number >= kMinFourierSolidCharacters;
+    pattern_ = pattern;
+    wildcard_ = wildcard;
+    pattern_length_ = pattern.size();
+    if (fourier_pattern_) {
+      fourier_matcher_.Init(pattern, wildcard);
+      // Drops the automaton and the counters of a previous pattern
+      aho_corasick_automaton_.reset();
+      word_shifts_.clear();
+      narrow_counters_ = CounterRing<uint16_t>();
+      wide_counters_ = CounterRing<uint32_t>();
+      number_of_words_ = 0;
+    } else {
+      BuildAutomaton();
+    }
+    Reset();
+  }
+
+  // Resets matcher to start scanning new stream, by the convolution engine
+  // again for its patterns
+  void Reset() {
+    scanned_characters_ = 0;
+    use_fourier_ = fourier_pattern_;
+    if (use_fourier_) {
+      fourier_matcher_.Reset();
+      state_ = aho_corasick::NodeReference();
+      return;
+    }
+    if (aho_corasick_automaton_) {
+      state_ = aho_corasick_automaton_->Root();
+    }
+    narrow_counters_.Clear();
+    wide_counters_.Clear();
+  }
+
+  // Ranges shorter than this take as long per call as ranges of this size
+  size_t PreferredRangeSize() const {
+    return use_fourier_ ? fourier_matcher_.BlockSize() : 1;
+  }
+
+  // The convolution engine would transform a whole block for every single
+  // character, so the first one switches the stream to the automaton
+  template <class Callback>
+  void Scan(char character, Callback on_match) {
+    if (use_fourier_) {
+      SwitchToAutomaton();
+    }
+    if (!state_) {
+      throw std::runtime_error("mather wasn't initialized");
+    }
+
+    const bool is_match = narrow_counters_.WindowSize() != 0
+        ? ScanCharacter(&narrow_counters_, character)
+        : ScanCharacter(&wide_counters_, character);
+    if (is_match) {
+       on_match();
+    }
+  }
+
+  // Scans characters of a range and calls on_match with the offset in the
+  // range of the last character of every match. Runs of characters which
+  // can not leave the root are found by a vectorized search and skipped
+  template <class Callback>
+  void Scan(const char * begin, const char * end, Callback on_match) {
+    if (use_fourier_) {
+      fourier_matcher_.Scan(begin, end, on_match);
+      return;
+    }
+    if (!state_) {
+      throw std::runtime_error("mather wasn't initialized");
+    }
+    if (narrow_counters_.WindowSize() != 0) {
+      ScanRange(&narrow_counters_, begin, end, on_match);
+    } else {
+      ScanRange(&wide_counters_, begin, end, on_match);
+    }
+  }
+ 
+ private:
+  static constexpr size_t kMaxDensePatternLength = 1 << 12;
+  // Measured crossover of the engines on mostly wildcard patterns
+  static constexpr size_t kMinFourierSolidCharacters = 512;
+
+  // Empty subpatterns occur everywhere, so only the others are added to
+  // the automaton and a match also needs the whole pattern to fit into
+  // the scanned text. The root then generates no matches, and runs of
+  // characters which keep the automaton in it can be skipped
+  void BuildAutomaton() {
+    const char wildcard = wildcard_;
+    auto pattern_splitted = Split(pattern_, [wildcard](char symbol) { 
+                                              return symbol == wildcard; 
+                                            });
+
+    aho_corasick::AutomatonBuilder automaton_builder;
+
+    // An occurrence of a subpattern ending at the scanned character votes
+    // for the window which ends word_shifts_[id] characters later
+    size_t right_end_position = 0;
+    word_shifts_.clear();
+    for (const auto &subpattern : pattern_splitted) {
+        right_end_position += subpattern.size() + 1;
+        if (!subpattern.empty()) {
+          automaton_builder.Add(subpattern, word_shifts_.size());
+          word_shifts_.push_back(pattern_length_ + 1 - right_end_position);
+        }
+    }
+    number_of_words_ = word_shifts_.size();
+
+    // Small patterns get the dense goto table: a pattern has at most
+    // kMaxDensePatternLength + 1 trie nodes of 1 KiB each, so the table
+    // stays in cache
+    aho_corasick_automaton_ = automaton_builder.Build(
+        pattern_length_ <= kMaxDensePatternLength ? aho_corasick::TransitionsMode::kDense
+                                                  : aho_corasick::TransitionsMode::kSparse);
+
+    // A window gets at most one vote of every subpattern
+    if (number_of_words_ <= std::numeric_limits<uint16_t>::max()) {
+      narrow_counters_.Assign(pattern_length_ + 1);
+      wide_counters_ = CounterRing<uint32_t>();
+    } else {
+      wide_counters_.Assign(pattern_length_ + 1);
+      narrow_counters_ = CounterRing<uint16_t>();
+    }
+  }
+
+  // Continues the stream of the convolution engine on the automaton. Its
+  // matches were reported up to the last scanned character, so the
+  // characters which the windows still open start with are replayed
+  // without reporting any
+  void SwitchToAutomaton() {
+    if (!aho_corasick_automaton_) {
+      BuildAutomaton();
+    }
+    const std::string recent_text = fourier_matcher_.RecentText();
+    const size_t scanned_number = fourier_matcher_.ScannedNumber();
+    use_fourier_ = false;
+    state_ = aho_corasick_automaton_->Root();
+    narrow_counters_.Clear();
+    wide_counters_.Clear();
+    scanned_characters_ = scanned_number - recent_text.size();
+    for (const char character : recent_text) {
+      if (narrow_counters_.WindowSize() != 0) {
+        ScanCharacter(&narrow_counters_, character);
+      } else {
+        ScanCharacter(&wide_counters_, character);
+      }
+    }
+  }
+
+  // Returns whether the window ending at the character matches
+  template <class Counter>
+  bool ScanCharacter(CounterRing<Counter> *counters, char character) {
+    state_ = state_.Next(character);
+    counters->Advance(1);
+    const std::vector<size_t> &word_shifts = word_shifts_;
+    state_.GenerateMatches([counters, &word_shifts](size_t word_id) {
+      ++(*counters)[word_shifts[word_id]];
+    });
+    ++scanned_characters_;
+
+    return IsMatch(*counters, 0);
+  }
+
+  template <class Counter, class Callback>
+  void ScanRange(CounterRing<Counter> *counters, const char * begin, const char * end,
+                 Callback on_match) {
+    const char * position = begin;
+    while (position != end) {
+      if (state_.IsRoot()) {
+        const char * root_exit = aho_corasick_automaton_->FindRootExit(position, end);
+        SkipCharacters(counters, root_exit - position,
+                       [&on_match, begin, position](size_t skipped) {
+                         on_match(position - begin + skipped);
+                       });
+        position = root_exit;
+        if (position == end) {
+          break;
+        }
+      }
+
+      if (ScanCharacter(counters, *position)) {
+        on_match(position - begin);
+      }
+      ++position;
+    }
+  }
+
+  // The counter at shift belongs to the match shift characters after the
+  // last scanned one
+  template <class Counter>
+  bool IsMatch(const CounterRing<Counter> &counters, size_t shift) const {
+    return counters[shift] == number_of_words_ &&
+           scanned_characters_ + shift >= pattern_length_;
+  }
+
+  // Scans characters which keep the automaton in the root: they generate
+  // no words, so counters are only shifted and checked for matches, which
+  // on_match gets as the index of a skipped character
+  template <class Counter, class Callback>
+  void SkipCharacters(CounterRing<Counter> *counters, size_t characters_number,
+                      Callback on_match) {
+    // Counters are zero behind the window, so only an automaton without
+    // words may match there
+    size_t checked_number = number_of_words_ == 0
+        ? characters_number
+        : std::min(characters_number, counters->WindowSize() - 1);
+    for (size_t skipped = 1; skipped <= checked_number; ++skipped) {
+      if (IsMatch(*counters, skipped)) {
+        on_match(skipped - 1);
+      }
+    }
+
+    counters->Advance(characters_number);
+    scanned_characters_ += characters_number;
+  }
+
+  // Storing only O(|pattern|) elements allows us
+  // to consume only O(|pattern|) memory for matcher. Only one of the rings
+  // is used, the narrow one unless the pattern has too many subpatterns
+  CounterRing<uint16_t> narrow_counters_;
+  CounterRing<uint32_t> wide_counters_;
+  std::vector<size_t> word_shifts_;
+  aho_corasick::NodeReference state_;
+  size_t number_of_words_;
+  size_t pattern_length_;
+  size_t scanned_characters_;
+  // Copies of a matcher share the automaton, which is never changed
+  // after Build(), so they can scan on different threads
+  std::shared_ptr<const aho_corasick::Automaton> aho_corasick_automaton_;
+  std::string pattern_;
+  char wildcard_;
+  // The pattern is matched by the convolution engine, the stream is until
+  // a single character is scanned
+  bool fourier_pattern_;
+  bool use_fourier_;
+  FourierWildcardMatcher fourier_matcher_;
+};
+
+// Finds many patterns with wildcards in one pass. Solid subpatterns of all
+// patterns share one automaton; an occurrence of a subpattern votes for
+// the window of its pattern which it fixes, and the window matches when
+// all its subpatterns voted. Windows of a pattern are counted in a ring
+// of its length, as a window is complete before the one that reuses its
+// counter gets votes, and complete windows wait in a queue until the scan
+// reaches their ends
+class MultiWildcardMatcher {
+ public:
+  MultiWildcardMatcher() : scanned_characters_(0) {}
+
+  void Init(const std::vector<std::string> &patterns, char wildcard) {
+    aho_corasick::AutomatonBuilder automaton_builder;
+    patterns_.clear();
+    subpatterns_.clear();
+    wildcard_only_patterns_.clear();
+    size_t total_length = 0;
+
+    for (size_t pattern_id = 0; pattern_id < patterns.size(); ++pattern_id) {
+      const std::string &pattern = patterns[pattern_id];
+      Pattern pattern_windows = {pattern.size(), 0, total_length};
+      total_length += pattern.size();
+
+      size_t subpattern_end = 0;
+      for (const auto &subpattern : Split(pattern, [wildcard](char symbol) {
+                                            return symbol == wildcard;
+                                          })) {
+        subpattern_end += subpattern.size();
+        if (!subpattern.empty()) {
+          automaton_builder.Add(subpattern, subpatterns_.size());
+          subpatterns_.push_back({pattern_id, subpattern_end - 1});
+          ++pattern_windows.subpatterns_number;
+        }
+        ++subpattern_end;
+      }
+
+      if (pattern_windows.subpatterns_number == 0) {
+        wildcard_only_patterns_.push_back(pattern_id);
+      }
+      patterns_.push_back(pattern_windows);
+    }
+
+    window_counters_.assign(total_length, WindowCounter());
+    // The dense goto table takes 1 KiB per trie node, so it is kept for
+    // dictionaries which stay in cache
+    aho_corasick_automaton_ = automaton_builder.Build(
+        total_length <= kMaxDensePatternsLength ? aho_corasick::TransitionsMode::kDense
+                                                : aho_corasick::TransitionsMode::kDoubleArray);
+    Reset();
+  }
+
+  // Resets matcher to start scanning new stream
+  void Reset() {
+    state_ = aho_corasick_automaton_->Root();
+    std::fill(window_counters_.begin(), window_counters_.end(), WindowCounter());
+    complete_windows_ = CompleteWindowsQueue();
+    scanned_characters_ = 0;
+  }
+
+  // Calls on_match with the id of every pattern matching at the character
+  template <class Callback>
+  void Scan(char character, Callback on_match) {
+    if (!state_) {
+      throw std::runtime_error("mather wasn't initialized");
+    }
+
+    const size_t position = scanned_characters_++;
+    state_ = state_.Next(character);
+    state_.GenerateMatches([this, position](size_t subpattern_id) {
+      Vote(subpatterns_[subpattern_id], position);
+    });
+
+    ReportMatches(position, on_match);
+  }
+
+  // Scans characters of a range and calls on_match with the pattern id and
+  // the offset in the range of the last character of every match
+  template <class Callback>
+  void Scan(const char * begin, const char * end, Callback on_match) {
+    if (!state_) {
+      throw std::runtime_error("mather wasn't initialized");
+    }
+
+    const char * position = begin;
+    while (position != end) {
+      // Only patterns of wildcards match without leaving the root
+      if (state_.IsRoot() && wildcard_only_patterns_.empty()) {
+        const char * root_exit = aho_corasick_automaton_->FindRootExit(position, end);
+        SkipCharacters(root_exit - position, [&on_match, begin, position](
+                                                 size_t pattern_id, size_t skipped) {
+          on_match(pattern_id, position - begin + skipped);
+        });
+        position = root_exit;
+        if (position == end) {
+          break;
+        }
+      }
+
+      Scan(*position, [&on_match, begin, position](size_t pattern_id) {
+        on_match(pattern_id, position - begin);
+      });
+      ++position;
+    }
+  }
+
+ private:
+  static constexpr size_t kMaxDensePatternsLength = 1 << 12;
+  static constexpr size_t kNoWindow = std::numeric_limits<size_t>::max();
+
+  struct Pattern {
+    size_t length;
+    size_t subpatterns_number;
+    // Ring of the window counters of the pattern in window_counters_
+    size_t first_window_counter;
+  };
+
+  struct Subpattern {
+    size_t pattern_id;
+    // Offset of the last character of the subpattern in the pattern
+    size_t last_character_offset;
+  };
+
+  struct WindowCounter {
+    WindowCounter() : window_begin(kNoWindow), votes(0) {}
+
+    size_t window_begin;
+    size_t votes;
+  };
+
+  // Ends and ids of patterns of complete windows, the nearest end on top
+  typedef std::pair<size_t, size_t> CompleteWindow;
+  typedef std::priority_queue<CompleteWindow, std::vector<CompleteWindow>,
+                              std::greater<CompleteWindow>> CompleteWindowsQueue;
+
+  void Vote(const Subpattern &subpattern, size_t position) {
+    if (position < subpattern.last_character_offset) {
+      return;
+    }
+
+    const size_t window_begin = position - subpattern.last_character_offset;
+    const Pattern &pattern = patterns_[subpattern.pattern_id];
+    WindowCounter &counter =
+        window_counters_[pattern.first_window_counter + window_begin % pattern.length];
+    if (counter.window_begin != window_begin) {
+      counter.window_begin = window_begin;
+      counter.votes = 0;
+    }
+
+    if (++counter.votes == pattern.subpatterns_number) {
+      complete_windows_.emplace(window_begin + pattern.length - 1, subpattern.pattern_id);
+    }
+  }
+
+  template <class Callback>
+  void ReportMatches(size_t position, Callback on_match) {
+    while (!complete_windows_.empty() && complete_windows_.top().first == position) {
+      on_match(complete_windows_.top().second);
+      complete_windows_.pop();
+    }
+
+    for (size_t pattern_id : wildcard_only_patterns_) {
+      if (position + 1 >= patterns_[pattern_id].length) {
+        on_match(pattern_id);
+      }
+    }
+  }
+
+  // Scans characters which keep the automaton in the root and vote for no
+  // windows, so only windows completed before end there; on_match gets
+  // the pattern id and the index of a skipped character
+  template <class Callback>
+  void SkipCharacters(size_t characters_number, Callback on_match) {
+    const size_t skip_end = scanned_characters_ + characters_number;
+    while (!complete_windows_.empty() && complete_windows_.top().first < skip_end) {
+      on_match(complete_windows_.top().second,
+               complete_windows_.top().first - scanned_characters_);
+      complete_windows_.pop();
+    }
+    scanned_characters_ = skip_end;
+  }
+
+  std::vector<Pattern> patterns_;
+  std::vector<Subpattern> subpatterns_;
+  std::vector<size_t> wildcard_only_patterns_;
+  std::vector<WindowCounter> window_counters_;
+  CompleteWindowsQueue complete_windows_;
+  aho_corasick::NodeReference state_;
+  size_t scanned_characters_;
+  std::shared_ptr<const aho_corasick::Automaton> aho_corasick_automaton_;
+};
+
+// Finds windows of the text which differ from a pattern with wildcards in
+// no more than max_mismatches characters by the Shift-Add algorithm. Every
+// pattern prefix has a counter of mismatches against the text ending at
+// the scanned character; a new character shifts the counters to longer
+// prefixes and adds its mismatches to all of them at once. Counters are
+// packed into 64-bit words, field_width bits each, where the top bit of a
+// field records that the counter went over max_mismatches and sticks.
+// Field widths are powers of two, so fields never cross words, and scans
+// of patterns of up to 1, 2 and 4 words have their own unrolled loops
+class MismatchMatcher {
+ public:
+  MismatchMatcher()
+      : pattern_length_(0),
+        max_mismatches_(0),
+        field_width_(0),
+        words_number_(0),
+        scanned_characters_(0) {}
+
+  void Init(const std::string &pattern, char wildcard, size_t max_mismatches) {
+    pattern_length_ = pattern.size();
+    // No window has more mismatches than the pattern has characters
+    max_mismatches_ = std::min(max_mismatches, pattern_length_);
+    field_width_ = 2;
+    while (field_width_ < kWordBits / 2 &&
+           (uint64_t(1) << (field_width_ - 1)) <= max_mismatches_) {
+      field_width_ *= 2;
+    }
+
+    const size_t fields_per_word = kWordBits / field_width_;
+    words_number_ = std::max<size_t>(1, (pattern_length_ + fields_per_word - 1) / fields_per_word);
+    if (words_number_ > 2 && words_number_ <= 4) {
+      words_number_ = 4;
+    }
+
+    overflow_bits_ = 0;
+    for (size_t field = 0; field < fields_per_word; ++field) {
+      overflow_bits_ |= uint64_t(1) << (field * field_width_ + field_width_ - 1);
+    }
+
+    mismatches_.assign(kAlphabetSize * words_number_, 0);
+    for (size_t offset = 0; offset < pattern_length_; ++offset) {
+      if (pattern[offset] == wildcard) {
+        continue;
+      }
+      const uint64_t mismatch = uint64_t(1) << (offset % fields_per_word * field_width_);
+      for (size_t character = 0; character < kAlphabetSize; ++character) {
+        if (static_cast<unsigned char>(pattern[offset]) != character) {
+          mismatches_[character * words_number_ + offset / fields_per_word] |= mismatch;
+        }
+      }
+    }
+
+    if (pattern_length_ > 0) {
+      last_field_word_ = (pattern_length_ - 1) / fields_per_word;
+      last_field_shift_ = (pattern_length_ - 1) % fields_per_word * field_width_;
+    }
+    Reset();
+  }
+
+  // Resets matcher to start scanning new stream
+  void Reset() {
+    counters_.assign(words_number_, 0);
+    overflows_.assign(words_number_, 0);
+    scanned_characters_ = 0;
+  }
+
+  template <class Callback>
+  void Scan(char character, Callback on_match) {
+    Scan(&character, &character + 1, [&on_match](size_t /*offset*/) { on_match(); });
+  }
+
+  // Scans characters of a range and calls on_match with the offset in the
+  // range of the last character of every match
+  template <class Callback>
+  void Scan(const char * begin, const char * end, Callback on_match) {
+    if (words_number_ == 0) {
+      throw std::runtime_error("mather wasn't initialized");
+    }
+
+    switch (words_number_) {
+      case 1:
+        ScanWords<1>(begin, end, on_match);
+        break;
+      case 2:
+        ScanWords<2>(begin, end, on_match);
+        break;
+      case 4:
+        ScanWords<4>(begin, end, on_match);
+        break;
+      default:
+        ScanWords<0>(begin, end, on_match);
+    }
+  }
+
+ private:
+  static constexpr size_t kWordBits = 64;
+  static constexpr size_t kAlphabetSize = 256;
+
+  // kWordsNumber equal to 0 takes words_number_ words
+  template <size_t kWordsNumber, class Callback>
+  void ScanWords(const char * begin, const char * end, Callback on_match) {
+    const size_t words_number = kWordsNumber != 0 ? kWordsNumber : words_number_;
+    const size_t carry_shift = kWordBits - field_width_;
+    uint64_t * counters = counters_.data();
+    uint64_t * overflows = overflows_.data();
+
+    for (const char * position = begin; position != end; ++position) {
+      const uint64_t * mismatches =
+          mismatches_.data() + static_cast<unsigned char>(*position) * words_number;
+      // Higher words go first, so lower ones still hold counters to carry
+      for (size_t word = words_number; word-- > 0;) {
+        uint64_t counter = counters[word] << field_width_;
+        uint64_t overflow = overflows[word] << field_width_;
+        if (word > 0) {
+          counter |= counters[word - 1] >> carry_shift;
+          overflow |= overflows[word - 1] >> carry_shift;
+        }
+        counter += mismatches[word];
+        overflows[word] = overflow | (counter & overflow_bits_);
+        counters[word] = counter & ~overflow_bits_;
+      }
+
+      ++scanned_characters_;
+      if (scanned_characters_ >= pattern_length_ && IsMatch(counters, overflows)) {
+        on_match(position - begin);
+      }
+    }
+  }
+
+  bool IsMatch(const uint64_t * counters, const uint64_t * overflows) const {
+    if (pattern_length_ == 0) {
+      return true;
+    }
+    const uint64_t field =
+        (counters[last_field_word_] | overflows[last_field_word_]) >> last_field_shift_;
+    return (field & ((uint64_t(1) << field_width_) - 1)) <= max_mismatches_;
+  }
+
+  size_t pattern_length_;
+  size_t max_mismatches_;
+  size_t field_width_;
+  size_t words_number_;
+  uint64_t overflow_bits_;
+  size_t last_field_word_;
+  size_t last_field_shift_;
+  // Bit masks of mismatching pattern characters for every byte
+  std::vector<uint64_t> mismatches_;
+  std::vector<uint64_t> counters_;
+  std::vector<uint64_t> overflows_;
+  size_t scanned_characters_;
+};
+
+std::string ReadString(std::istream &input_stream) {
+  std::string input_string;
+  std::getline(input_stream, input_string);
+
+  return input_string;
+}
+
+// Returns positions of the first character of every match
+std::vector<size_t> FindFuzzyMatches(const std::string &pattern_with_wildcards,
+                                     const std::string &text, char wildcard) {
+  WildcardMatcher wildcard_matcher;
   wildcard_matcher.Init(pattern_with_wildcards, wildcard);
 
   std::vector<size_t> matches_positions;
-  for (size_t offset = 0; offset < text.size(); ++offset) {
-    wildcard_matcher.Scan(text[offset],
-                          [&matches_positions, offset, &pattern_with_wildcards] {
-                            matches_positions.push_back(offset + 1 - 
-                                                        pattern_with_wildcards.size());
-                          });
-  }
+  wildcard_matcher.Scan(text.data(), text.data() + text.size(),
+                        [&matches_positions, &pattern_with_wildcards](size_t offset) {
+                          matches_positions.push_back(offset + 1 - 
+                                                      pattern_with_wildcards.size());
+                        });
   
   return matches_positions;
 }
 
+// Returns positions of the first character of every window which differs
+// from the pattern in no more than max_mismatches characters other than
+// wildcards
+std::vector<size_t> FindFuzzyMatches(const std::string &pattern_with_wildcards,
+                                     const std::string &text, char wildcard,
+                                     size_t max_mismatches) {
+  MismatchMatcher mismatch_matcher;
+  mismatch_matcher.Init(pattern_with_wildcards, wildcard, max_mismatches);
+
+  std::vector<size_t> matches_positions;
+  mismatch_matcher.Scan(text.data(), text.data() + text.size(),
+                        [&matches_positions, &pattern_with_wildcards](size_t offset) {
+                          matches_positions.push_back(offset + 1 -
+                                                      pattern_with_wildcards.size());
+                        });
+
+  return matches_positions;
+}
+
+// Returns pairs of a pattern id and a position of the first character of
+// its match, sorted by positions and then by ids
+std::vector<std::pair<size_t, size_t>> FindFuzzyMatches(
+    const std::vector<std::string> &patterns_with_wildcards, const std::string &text,
+    char wildcard) {
+  MultiWildcardMatcher wildcard_matcher;
+  wildcard_matcher.Init(patterns_with_wildcards, wildcard);
+
+  std::vector<std::pair<size_t, size_t>> matches;
+  wildcard_matcher.Scan(text.data(), text.data() + text.size(),
+                        [&matches, &patterns_with_wildcards](size_t pattern_id,
+                                                             size_t offset) {
+                          matches.emplace_back(
+                              pattern_id,
+                              offset + 1 - patterns_with_wildcards[pattern_id].size());
+                        });
+
+  std::sort(matches.begin(), matches.end(),
+            [](const std::pair<size_t, size_t> &first,
+               const std::pair<size_t, size_t> &second) {
+              return std::make_pair(first.second, first.first) <
+                     std::make_pair(second.second, second.first);
+            });
+  return matches;
+}
+
+// Chunks shorter than that are not worth a thread
+constexpr size_t kMinParallelChunkLength = 1 << 16;
+
+// Splits the text into chunks scanned on separate threads. A chunk is
+// scanned from pattern length - 1 characters before it, so matches which
+// cross its left border are found, and keeps only matches ending in it.
+// Matches of a chunk are sorted, so chunks are simply concatenated.
+// threads_number equal to 0 takes all hardware threads
+std::vector<size_t> FindFuzzyMatchesInParallel(const std::string &pattern_with_wildcards,
+                                               const std::string &text, char wildcard,
+                                               size_t threads_number) {
+  WildcardMatcher wildcard_matcher;
+  wildcard_matcher.Init(pattern_with_wildcards, wildcard);
+
+  if (threads_number == 0) {
+    threads_number = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const size_t chunks_number = std::max<size_t>(
+      1, std::min(threads_number, text.size() / kMinParallelChunkLength));
+  const size_t overlap =
+      pattern_with_wildcards.empty() ? 0 : pattern_with_wildcards.size() - 1;
+
+  std::vector<std::vector<size_t>> chunks_matches_positions(chunks_number);
+  auto scan_chunk = [&](size_t chunk) {
+    const size_t chunk_begin = text.size() * chunk / chunks_number;
+    const size_t chunk_end = text.size() * (chunk + 1) / chunks_number;
+    const size_t scan_begin = chunk_begin - std::min(chunk_begin, overlap);
+    std::vector<size_t> &matches_positions = chunks_matches_positions[chunk];
+
+    WildcardMatcher chunk_matcher(wildcard_matcher);
+    chunk_matcher.Scan(text.data() + scan_begin, text.data() + chunk_end,
+                       [&matches_positions, &pattern_with_wildcards, scan_begin,
+                        chunk_begin](size_t offset) {
+                         if (scan_begin + offset >= chunk_begin) {
+                           matches_positions.push_back(scan_begin + offset + 1 -
+                                                       pattern_with_wildcards.size());
+                         }
+                       });
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t chunk = 1; chunk < chunks_number; ++chunk) {
+    threads.emplace_back(scan_chunk, chunk);
+  }
+  scan_chunk(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  std::vector<size_t> matches_positions;
+  for (const auto &chunk_matches_positions : chunks_matches_positions) {
+    matches_positions.insert(matches_positions.end(), chunk_matches_positions.begin(),
+                             chunk_matches_positions.end());
+  }
+  return matches_positions;
+}
+
+// Read-only private mapping of a whole file, unmapped on destruction.
+// An empty file is valid and gives an empty range with no data, as mmap
+// rejects zero lengths; only failures of fstat and mmap throw
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &path) : data_(nullptr), size_(0) {
+    int descriptor = open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+      throw std::runtime_error("can not open " + path);
+    }
+
+    struct stat file_status;
+    if (fstat(descriptor, &file_status) != 0) {
+      close(descriptor);
+      throw std::runtime_error("can not stat " + path);
+    }
+    if (file_status.st_size == 0) {
+      close(descriptor);
+      return;
+    }
+
+    void * mapping = mmap(nullptr, file_status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error("can not map " + path);
+    }
+    data_ = static_cast<const char *>(mapping);
+    size_ = file_status.st_size;
+    madvise(mapping, size_, MADV_SEQUENTIAL);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  const char * Data() const { return data_; }
+
+  size_t Size() const { return size_; }
+
+ private:
+  const char * data_;
+  size_t size_;
+};
+
+constexpr size_t kStreamBufferSize = 1 << 20;
+
+// Scans the input through one buffer of buffer_size bytes, grown to a
+// whole transform block for patterns of the convolution engine. The
+// matcher keeps its state between buffers, so on_match gets the absolute
+// position of the first character of every match, in increasing order
+template <class Callback>
+void FindFuzzyMatchesInStream(const std::string &pattern_with_wildcards,
+                              std::istream &input_stream, char wildcard,
+                              Callback on_match,
+                              size_t buffer_size = kStreamBufferSize) {
+  WildcardMatcher wildcard_matcher;
+  wildcard_matcher.Init(pattern_with_wildcards, wildcard);
+
+  std::vector<char> buffer(std::max(buffer_size, wildcard_matcher.PreferredRangeSize()));
+  size_t buffer_position = 0;
+  while (input_stream) {
+    input_stream.read(buffer.data(), buffer.size());
+    const size_t read_size = input_stream.gcount();
+    wildcard_matcher.Scan(buffer.data(), buffer.data() + read_size,
+                          [&on_match, &pattern_with_wildcards,
+                           buffer_position](size_t offset) {
+                            on_match(buffer_position + offset + 1 -
+                                     pattern_with_wildcards.size());
+                          });
+    buffer_position += read_size;
+  }
+}
+
+// Scans a mapped file without copying it; on_match gets positions of the
+// first characters of matches in the file, in increasing order
+template <class Callback>
+void FindFuzzyMatchesInFile(const std::string &pattern_with_wildcards,
+                            const std::string &path, char wildcard, Callback on_match) {
+  WildcardMatcher wildcard_matcher;
+  wildcard_matcher.Init(pattern_with_wildcards, wildcard);
+
+  MappedFile file(path);
+  wildcard_matcher.Scan(file.Data(), file.Data() + file.Size(),
+                        [&on_match, &pattern_with_wildcards](size_t offset) {
+                          on_match(offset + 1 - pattern_with_wildcards.size());
+                        });
+}
+
 void Print(const std::vector<size_t> &sequence) {
   std::cout << sequence.size() << std::endl;
   
@@ -446,13 +2010,156 @@ void Print(const std::vector<size_t> &sequence) {
   std::cout << std::endl;
 }
 
+// Builds the automaton of a dictionary, one word per line, in the given
+// transitions modes and prints its memory and scan throughput as csv.
+// The text is read from text_path or, if it is empty, made of random
+// dictionary words and letters up to text_length bytes
+int RunReport(const std::string &dictionary_path, const std::string &text_path,
+              size_t text_length, const std::string &transitions) {
+  std::ifstream dictionary_stream(dictionary_path.c_str(), std::ios::binary);
+  if (!dictionary_stream) {
+    throw std::runtime_error("can not read " + dictionary_path);
+  }
+  std::vector<std::string> dictionary;
+  for (std::string word; std::getline(dictionary_stream, word);) {
+    dictionary.push_back(word);
+  }
+
+  std::string text;
+  if (!text_path.empty()) {
+    std::ifstream text_stream(text_path.c_str(), std::ios::binary);
+    text.assign(std::istreambuf_iterator<char>(text_stream),
+                std::istreambuf_iterator<char>());
+  } else {
+    std::mt19937 generator(1);
+    while (text.size() < text_length) {
+      if (!dictionary.empty() && generator() % 2 == 0) {
+        text += dictionary[generator() % dictionary.size()];
+      } else {
+        text += static_cast<char>('a' + generator() % 26);
+      }
+    }
+    text.resize(text_length);
+  }
+
+  aho_corasick::AutomatonBuilder automaton_builder;
+  for (size_t word_index = 0; word_index < dictionary.size(); ++word_index) {
+    automaton_builder.Add(dictionary[word_index], word_index);
+  }
 
+  std::cout << "transitions,words,nodes,memory_bytes,bytes_per_node,build_seconds,"
+               "text_bytes,scan_seconds,mb_per_second,matches" << std::endl;
+  const std::map<std::string, aho_corasick::TransitionsMode> kModes = {
+      {"sparse", aho_corasick::TransitionsMode::kSparse},
+      {"double_array", aho_corasick::TransitionsMode::kDoubleArray},
+      {"dense", aho_corasick::TransitionsMode::kDense}};
+
+  for (const auto &mode_name : Split(transitions, [](char symbol) {
+                                       return symbol == ',';
+                                     })) {
+    if (kModes.count(mode_name) == 0) {
+      throw std::invalid_argument("unknown transitions " + mode_name);
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto automaton = automaton_builder.Build(kModes.at(mode_name));
+    double build_seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    size_t matches = 0;
+    aho_corasick::NodeReference state = automaton->Root();
+    for (const char character : text) {
+      state = state.Next(character);
+      state.GenerateMatches([&matches](size_t /*id*/) { ++matches; });
+    }
+    double scan_seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::cout << mode_name << "," << dictionary.size() << ","
+              << automaton->NodesNumber() << "," << automaton->MemoryUsage() << ","
+              << automaton->MemoryUsage() / automaton->NodesNumber() << ","
+              << build_seconds << "," << text.size() << "," << scan_seconds << ","
+              << text.size() / scan_seconds / 1e6 << "," << matches << std::endl;
+  }
+
+  return 0;
+}
+
+// Reads a pattern with wildcards and a text from stdin and prints the
+// matches, scanning on --threads=N threads (0 takes all of them), or
+// the windows with up to --mismatches=k mismatching characters. With
+// --input=path the text is the whole file, mapped or, given --buffer=bytes,
+// read through a buffer of that size (at least a transform block for the
+// convolution engine), and positions of matches are
+// printed one per line as soon as they are found. With --report=dictionary [--text=path] [--length=bytes]
+// [--transitions=sparse,double_array,dense] it prints the memory and
+// throughput report of the dictionary instead
 int main(int argc, char * argv[]) {
+  std::string dictionary_path;
+  std::string text_path;
+  size_t text_length = 10000000;
+  std::string transitions = "sparse,double_array,dense";
+  size_t threads_number = 1;
+  std::string input_path;
+  size_t buffer_size = 0;
+  size_t max_mismatches = 0;
+  for (int argument_id = 1; argument_id < argc; ++argument_id) {
+    std::string argument = argv[argument_id];
+    size_t equality = argument.find('=');
+    std::string name = argument.substr(0, equality);
+    std::string value = equality == std::string::npos ? "" : argument.substr(equality + 1);
+    if (name == "--report") {
+      dictionary_path = value;
+    } else if (name == "--text") {
+      text_path = value;
+    } else if (name == "--length") {
+      text_length = std::stoul(value);
+    } else if (name == "--transitions") {
+      transitions = value;
+    } else if (name == "--threads") {
+      threads_number = std::stoul(value);
+    } else if (name == "--input") {
+      input_path = value;
+    } else if (name == "--buffer") {
+      buffer_size = std::stoul(value);
+    } else if (name == "--mismatches") {
+      max_mismatches = std::stoul(value);
+    } else {
+      throw std::invalid_argument("unexpected argument " + argument);
+    }
+  }
+  if (!dictionary_path.empty()) {
+    return RunReport(dictionary_path, text_path, text_length, transitions);
+  }
+
   constexpr char kWildcard = '?';
   const std::string pattern_with_wildcards = ReadString(std::cin);
+  if (!input_path.empty()) {
+    auto print_position = [](size_t position) { std::cout << position << "\n"; };
+    if (buffer_size == 0) {
+      FindFuzzyMatchesInFile(pattern_with_wildcards, input_path, kWildcard,
+                             print_position);
+    } else {
+      std::ifstream input_stream(input_path.c_str(), std::ios::binary);
+      if (!input_stream) {
+        throw std::runtime_error("can not read " + input_path);
+      }
+      FindFuzzyMatchesInStream(pattern_with_wildcards, input_stream, kWildcard,
+                               print_position, buffer_size);
+    }
+    return 0;
+  }
+
   const std::string text = ReadString(std::cin);
   
-  Print(FindFuzzyMatches(pattern_with_wildcards, text, kWildcard));
+  if (max_mismatches > 0) {
+    Print(FindFuzzyMatches(pattern_with_wildcards, text, kWildcard, max_mismatches));
+  } else if (threads_number == 1) {
+    Print(FindFuzzyMatches(pattern_with_wildcards, text, kWildcard));
+  } else {
+    Print(FindFuzzyMatchesInParallel(pattern_with_wildcards, text, kWildcard,
+                                     threads_number));
+  }
   
   return 0;
 }
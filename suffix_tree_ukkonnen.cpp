@@ -3,222 +3,2412 @@
 #include <algorithm>
 #include <iostream>
 #include <random>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <iterator>
+#include <type_traits>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <deque>
 
-const size_t kNoEdge = 1000000000;
+// Nodes and edges are addressed by 32-bit indices into the arenas of
+// their SuffixTree, which is enough for strings up to 2^31 symbols
+const uint32_t kNoEdge = std::numeric_limits<uint32_t>::max();
+const uint32_t kNoNode = std::numeric_limits<uint32_t>::max();
+const uint32_t kNoSuffix = std::numeric_limits<uint32_t>::max();
 const size_t kFinalAlphabetSize = 26;
 const size_t kOneSymbolLength = 1;
-
-struct Edge;
-struct Node;
+const size_t kMaxStringLength = std::numeric_limits<uint32_t>::max() / 2;
 
 struct Edge {
-	Node * upper_node_pointer;
-	Node * lower_node_pointer;
-	size_t left_substring_bound;
-	size_t right_substring_bound;
+	uint32_t upper_node;
+	uint32_t lower_node;
+	uint32_t left_substring_bound;
+	uint32_t right_substring_bound;
 };
 
+// Every suffix ends in its own leaf thanks to the terminator appended to
+// each document. Terminators are not symbols of the alphabet, so edges
+// labeled by one alone are kept out of the transitions in a list which
+// starts at terminal_edge of the parent and continues through
+// terminal_edge of the leaves hanging below it
 struct Node {
-    Edge * upper_going_edge;
-    std::vector<Edge *> down_going_edges;
-    std::vector<size_t> unicode_to_index = std::vector<size_t>(kFinalAlphabetSize, kNoEdge);
-    Node * suffix_link_pointer;
+	uint32_t upper_going_edge;
+	uint32_t suffix_link;
+	uint32_t terminal_edge;
+	// Start of the suffix spelled by a leaf, kNoSuffix for inner nodes
+	uint32_t suffix_start;
+};
+
+// Contiguous array which either owns its elements or views read-only
+// memory, e.g. a mapped file. Reads go through a raw pointer in both
+// cases. Mutating members copy viewed elements into owned storage first,
+// writes through operator[] expect the caller to Detach beforehand
+template <class T>
+class FlatArray {
+	public:
+		FlatArray() : data_(nullptr), size_(0), viewing_(false) {}
+
+		FlatArray(const FlatArray& other) : owned_(other.begin(), other.end()), viewing_(false) {
+			Sync();
+		}
+
+		FlatArray& operator=(const FlatArray& other) {
+			if (this != &other) {
+				owned_.assign(other.begin(), other.end());
+				viewing_ = false;
+				Sync();
+			}
+			return *this;
+		}
+
+		// Moves keep a view a view, so a loaded object can be moved in
+		FlatArray(FlatArray&& other) : FlatArray() {
+			swap(other);
+		}
+
+		FlatArray& operator=(FlatArray&& other) {
+			swap(other);
+			return *this;
+		}
+
+		void View(const T * data, size_t size) {
+			std::vector<T>().swap(owned_);
+			data_ = const_cast<T *>(data);
+			size_ = size;
+			viewing_ = true;
+		}
+
+		void Detach() {
+			if (viewing_) {
+				owned_.assign(data_, data_ + size_);
+				viewing_ = false;
+				Sync();
+			}
+		}
+
+		const T& operator[](size_t index) const {
+			return data_[index];
+		}
+
+		T& operator[](size_t index) {
+			return data_[index];
+		}
+
+		const T * begin() const {
+			return data_;
+		}
+
+		const T * end() const {
+			return data_ + size_;
+		}
+
+		const T& back() const {
+			return data_[size_ - 1];
+		}
+
+		size_t size() const {
+			return size_;
+		}
+
+		bool empty() const {
+			return size_ == 0;
+		}
+
+		size_t capacity() const {
+			return viewing_ ? size_ : owned_.capacity();
+		}
+
+		void clear() {
+			viewing_ = false;
+			owned_.clear();
+			Sync();
+		}
+
+		void reserve(size_t capacity) {
+			Detach();
+			owned_.reserve(capacity);
+			Sync();
+		}
+
+		void resize(size_t size, const T& value = T()) {
+			Detach();
+			owned_.resize(size, value);
+			Sync();
+		}
+
+		void assign(size_t size, const T& value) {
+			viewing_ = false;
+			owned_.assign(size, value);
+			Sync();
+		}
+
+		void push_back(const T& value) {
+			Detach();
+			owned_.push_back(value);
+			Sync();
+		}
+
+		template <class Iterator>
+		void append(Iterator first, Iterator last) {
+			Detach();
+			owned_.insert(owned_.end(), first, last);
+			Sync();
+		}
+
+		void swap(FlatArray& other) {
+			owned_.swap(other.owned_);
+			std::swap(data_, other.data_);
+			std::swap(size_, other.size_);
+			std::swap(viewing_, other.viewing_);
+		}
+
+	private:
+		void Sync() {
+			data_ = owned_.data();
+			size_ = owned_.size();
+		}
+
+		std::vector<T> owned_;
+		T * data_;
+		size_t size_;
+		bool viewing_;
+};
+
+// Read-only private mapping of a whole file, unmapped on destruction.
+// An empty file is an empty mapping with no data
+class MappedFile {
+	public:
+		explicit MappedFile(const std::string& path) : data_(nullptr), size_(0) {
+			int descriptor = open(path.c_str(), O_RDONLY);
+			if (descriptor < 0) {
+				throw std::runtime_error("can not open " + path);
+			}
+
+			struct stat file_status;
+			bool mapped = fstat(descriptor, &file_status) == 0;
+			if (mapped && file_status.st_size > 0) {
+				size_ = file_status.st_size;
+				void * mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, descriptor, 0);
+				mapped = mapping != MAP_FAILED;
+				data_ = mapped ? static_cast<const char *>(mapping) : nullptr;
+			}
+			close(descriptor);
+
+			if (!mapped) {
+				size_ = 0;
+				throw std::runtime_error("can not map " + path);
+			}
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		~MappedFile() {
+			if (data_ != nullptr) {
+				munmap(const_cast<char *>(data_), size_);
+			}
+		}
+
+		const char * Data() const {
+			return data_;
+		}
+
+		size_t Size() const {
+			return size_;
+		}
+
+	private:
+		const char * data_;
+		size_t size_;
+};
+
+// Archives are passed to Serialize(archive) methods, which list every
+// FlatArray via archive.Array and every scalar via archive.Value in a
+// fixed order. Values are stored as 64-bit words and arrays are aligned,
+// so a saved file can be viewed in place after mapping it
+const size_t kArchiveAlignment = 64;
+
+class FileWriteArchive {
+	public:
+		explicit FileWriteArchive(const std::string& path) 
+				: output_(path.c_str(), std::ios::binary | std::ios::trunc), offset_(0) {
+			if (!output_) {
+				throw std::runtime_error("can not open " + path);
+			}
+		}
+
+		template <class T>
+		void Array(const FlatArray<T>& array) {
+			ArrayHeader<T>(array.size());
+			ArrayPart(array.begin(), array.size());
+		}
+
+		// Streams an array which does not fit into memory: the header once,
+		// then parts which add up to size elements
+		template <class T>
+		void ArrayHeader(uint64_t size) {
+			static_assert(std::is_trivially_copyable<T>::value, "only plain data can be mapped");
+			Value(size);
+			Write(nullptr, (kArchiveAlignment - offset_ % kArchiveAlignment) % kArchiveAlignment);
+		}
+
+		template <class T>
+		void ArrayPart(const T * data, size_t size) {
+			Write(data, size * sizeof(T));
+		}
+
+		template <class T>
+		void Value(const T& value) {
+			uint64_t word = value;
+			Write(&word, sizeof(word));
+		}
+
+		void Finish() {
+			output_.flush();
+			if (!output_) {
+				throw std::runtime_error("failed to write archive");
+			}
+		}
+
+	private:
+		void Write(const void * data, size_t size) {
+			if (data == nullptr) {
+				static const char kPadding[kArchiveAlignment] = {};
+				data = kPadding;
+			}
+			output_.write(static_cast<const char *>(data), size);
+			offset_ += size;
+		}
+
+		std::ofstream output_;
+		uint64_t offset_;
+};
+
+// Points arrays into the mapping instead of copying them
+class MappedReadArchive {
+	public:
+		explicit MappedReadArchive(const std::string& path) 
+				: file_(std::make_shared<MappedFile>(path)), offset_(0) {}
+
+		template <class T>
+		void Array(FlatArray<T>& array) {
+			uint64_t size = 0;
+			Value(size);
+			offset_ += (kArchiveAlignment - offset_ % kArchiveAlignment) % kArchiveAlignment;
+			if (size > (file_->Size() - std::min<uint64_t>(offset_, file_->Size())) / sizeof(T)) {
+				throw std::runtime_error("archive is truncated");
+			}
+			array.View(reinterpret_cast<const T *>(file_->Data() + offset_), size);
+			offset_ += size * sizeof(T);
+		}
+
+		template <class T>
+		void Value(T& value) {
+			uint64_t word = 0;
+			if (offset_ + sizeof(word) > file_->Size()) {
+				throw std::runtime_error("archive is truncated");
+			}
+			std::memcpy(&word, file_->Data() + offset_, sizeof(word));
+			offset_ += sizeof(word);
+			value = static_cast<T>(word);
+		}
+
+		std::shared_ptr<const MappedFile> File() const {
+			return file_;
+		}
+
+	private:
+		std::shared_ptr<const MappedFile> file_;
+		uint64_t offset_;
+};
+
+// Turns every viewed array into an owned copy, before modifications
+class DetachArchive {
+	public:
+		template <class T>
+		void Array(FlatArray<T>& array) {
+			array.Detach();
+		}
+
+		template <class T>
+		void Value(T& /*value*/) {}
+};
+
+// Reads a layout tag from an archive or writes it, and rejects files
+// whose layout does not match the reading type
+template <class Archive>
+void CheckArchiveTag(Archive& archive, uint64_t expected_tag) {
+	uint64_t tag = expected_tag;
+	archive.Value(tag);
+	if (tag != expected_tag) {
+		throw std::runtime_error("archive layout does not match");
+	}
+}
+
+// Transition policies map (node, symbol) to the edge going down from the
+// node whose label starts with that symbol. A policy is told about every
+// new node via AddNode, symbols are inserted at most once per node and
+// ForEach visits (symbol, edge) pairs of one node. FirstEdge and NextEdge
+// walk the same children one at a time without any extra state.
+// Serialize lists the arrays of the policy for the archives above.
+// kOrderedEdges tells whether the children come in symbol order.
+// kConcurrentInserts tells that inserts into different nodes may run on
+// different threads once all nodes are added. Accepts tells whether a
+// symbol can be inserted at all, so a text is checked before building.
+
+// One slot per alphabet symbol per node: a single load per lookup,
+// but every node pays for the whole alphabet
+template <class Symbol = char, size_t kAlphabetSize = kFinalAlphabetSize, Symbol kFirstSymbol = 'a'>
+class DenseTransitions {
+	public:
+		static const bool kOrderedEdges = true;
+		static const bool kConcurrentInserts = true;
+
+		void Clear() {
+			table_.clear();
+		}
+
+		void Reserve(size_t nodes_number) {
+			table_.reserve(nodes_number * kAlphabetSize);
+		}
+
+		void AddNode() {
+			table_.resize(table_.size() + kAlphabetSize, kNoEdge);
+		}
+
+		uint32_t Find(uint32_t node, Symbol symbol) const {
+			size_t symbol_id = SymbolId(symbol);
+			if (symbol_id >= kAlphabetSize) {
+				return kNoEdge;
+			}
+
+			return table_[node * kAlphabetSize + symbol_id];
+		}
+
+		static bool Accepts(Symbol symbol) {
+			return SymbolId(symbol) < kAlphabetSize;
+		}
+
+		void Insert(uint32_t node, Symbol symbol, uint32_t edge) {
+			size_t symbol_id = SymbolId(symbol);
+			if (symbol_id >= kAlphabetSize) {
+				throw std::invalid_argument("symbol is outside of the dense alphabet");
+			}
+
+			table_[node * kAlphabetSize + symbol_id] = edge;
+		}
+
+		template <class Visitor>
+		void ForEach(uint32_t node, Visitor visitor) const {
+			for (size_t symbol_id = 0; symbol_id < kAlphabetSize; ++symbol_id) {
+				uint32_t edge = table_[node * kAlphabetSize + symbol_id];
+				if (edge != kNoEdge) {
+					visitor(Symbol(kFirstSymbol + symbol_id), edge);
+				}
+			}
+		}
+
+		uint32_t FirstEdge(uint32_t node) const {
+			return EdgeStartingFrom(node, 0);
+		}
+
+		uint32_t NextEdge(uint32_t node, Symbol symbol, uint32_t /*edge*/) const {
+			return EdgeStartingFrom(node, SymbolId(symbol) + 1);
+		}
+
+		template <class Archive>
+		void Serialize(Archive& archive) {
+			CheckArchiveTag(archive, kAlphabetSize);
+			archive.Array(table_);
+		}
+
+	private:
+		static size_t SymbolId(Symbol symbol) {
+			return static_cast<typename std::make_unsigned<Symbol>::type>(symbol - kFirstSymbol);
+		}
+
+		uint32_t EdgeStartingFrom(uint32_t node, size_t symbol_id) const {
+			for (; symbol_id < kAlphabetSize; ++symbol_id) {
+				if (table_[node * kAlphabetSize + symbol_id] != kNoEdge) {
+					return table_[node * kAlphabetSize + symbol_id];
+				}
+			}
+
+			return kNoEdge;
+		}
+
+		FlatArray<uint32_t> table_;
+};
+
+// Children of a node form a singly linked list of edges sorted by symbol.
+// Costs 4 bytes per node and 8 per edge, lookups probe linearly, which
+// is cheap for the 2-3 children most internal nodes have
+template <class Symbol>
+class SortedTransitions {
+	public:
+		static const bool kOrderedEdges = true;
+		static const bool kConcurrentInserts = true;
+
+		void Clear() {
+			first_edge_.clear();
+			siblings_.clear();
+		}
+
+		void Reserve(size_t nodes_number) {
+			first_edge_.reserve(nodes_number);
+			siblings_.reserve(nodes_number);
+		}
+
+		// A tree has fewer edges than nodes, so Insert never resizes the
+		// siblings and threads inserting into different nodes never meet
+		void AddNode() {
+			first_edge_.push_back(kNoEdge);
+			siblings_.push_back(Sibling{kNoEdge, Symbol()});
+		}
+
+		uint32_t Find(uint32_t node, Symbol symbol) const {
+			uint32_t edge = first_edge_[node];
+			while (edge != kNoEdge && siblings_[edge].symbol < symbol) {
+				edge = siblings_[edge].next_edge;
+			}
+
+			if (edge != kNoEdge && siblings_[edge].symbol == symbol) {
+				return edge;
+			}
+
+			return kNoEdge;
+		}
+
+		static bool Accepts(Symbol /*symbol*/) {
+			return true;
+		}
+
+		void Insert(uint32_t node, Symbol symbol, uint32_t edge) {
+			if (siblings_.size() <= edge) {
+				siblings_.resize(edge + 1);
+			}
+			siblings_[edge].symbol = symbol;
+
+			uint32_t * link = &first_edge_[node];
+			while (*link != kNoEdge && siblings_[*link].symbol < symbol) {
+				link = &siblings_[*link].next_edge;
+			}
+			siblings_[edge].next_edge = *link;
+			*link = edge;
+		}
+
+		template <class Visitor>
+		void ForEach(uint32_t node, Visitor visitor) const {
+			for (uint32_t edge = first_edge_[node]; edge != kNoEdge; edge = siblings_[edge].next_edge) {
+				visitor(siblings_[edge].symbol, edge);
+			}
+		}
+
+		uint32_t FirstEdge(uint32_t node) const {
+			return first_edge_[node];
+		}
+
+		uint32_t NextEdge(uint32_t /*node*/, Symbol /*symbol*/, uint32_t edge) const {
+			return siblings_[edge].next_edge;
+		}
+
+		template <class Archive>
+		void Serialize(Archive& archive) {
+			CheckArchiveTag(archive, kArchiveTag);
+			archive.Array(first_edge_);
+			archive.Array(siblings_);
+		}
+
+	private:
+		struct Sibling {
+			uint32_t next_edge;
+			Symbol symbol;
+		};
+
+		static const uint64_t kArchiveTag = 0x534f52544544;
+
+		FlatArray<uint32_t> first_edge_;
+		FlatArray<Sibling> siblings_;
+};
+
+// One open addressing table keyed by (node, symbol) shared by all nodes.
+// Lookups stay O(1) for large alphabets, where sibling lists get long
+// and dense slots are mostly empty. New children are prepended to the
+// list of their node, so ForEach visits them newest first
+template <class Symbol>
+class HashTransitions {
+	static_assert(sizeof(Symbol) <= sizeof(uint32_t), "symbol must fit into the lower half of a key");
+
+	public:
+		static const bool kOrderedEdges = false;
+		static const bool kConcurrentInserts = false;
+
+		HashTransitions() : size_(0) {}
+
+		void Clear() {
+			slots_.clear();
+			first_edge_.clear();
+			siblings_.clear();
+			size_ = 0;
+		}
+
+		void Reserve(size_t nodes_number) {
+			first_edge_.reserve(nodes_number);
+			siblings_.reserve(nodes_number);
+			Rehash(2 * nodes_number);
+		}
+
+		void AddNode() {
+			first_edge_.push_back(kNoEdge);
+		}
+
+		uint32_t Find(uint32_t node, Symbol symbol) const {
+			if (slots_.empty()) {
+				return kNoEdge;
+			}
+
+			uint64_t key = Key(node, symbol);
+			for (size_t slot = Hash(key); ; slot = (slot + 1) & (slots_.size() - 1)) {
+				if (slots_[slot].edge == kNoEdge) {
+					return kNoEdge;
+				}
+				if (slots_[slot].key == key) {
+					return slots_[slot].edge;
+				}
+			}
+		}
+
+		static bool Accepts(Symbol /*symbol*/) {
+			return true;
+		}
+
+		void Insert(uint32_t node, Symbol symbol, uint32_t edge) {
+			if (2 * (size_ + 1) > slots_.size()) {
+				Rehash(std::max<size_t>(2 * slots_.size(), kMinimalSlotsNumber));
+			}
+			Place(Key(node, symbol), edge);
+			++size_;
+
+			if (siblings_.size() <= edge) {
+				siblings_.resize(edge + 1);
+			}
+			siblings_[edge].symbol = symbol;
+			siblings_[edge].next_edge = first_edge_[node];
+			first_edge_[node] = edge;
+		}
+
+		template <class Visitor>
+		void ForEach(uint32_t node, Visitor visitor) const {
+			for (uint32_t edge = first_edge_[node]; edge != kNoEdge; edge = siblings_[edge].next_edge) {
+				visitor(siblings_[edge].symbol, edge);
+			}
+		}
+
+		uint32_t FirstEdge(uint32_t node) const {
+			return first_edge_[node];
+		}
+
+		uint32_t NextEdge(uint32_t /*node*/, Symbol /*symbol*/, uint32_t edge) const {
+			return siblings_[edge].next_edge;
+		}
+
+		template <class Archive>
+		void Serialize(Archive& archive) {
+			CheckArchiveTag(archive, kArchiveTag);
+			archive.Array(first_edge_);
+			archive.Array(siblings_);
+			archive.Array(slots_);
+			archive.Value(size_);
+		}
+
+	private:
+		struct Slot {
+			uint64_t key;
+			uint32_t edge;
+		};
+
+		struct Sibling {
+			uint32_t next_edge;
+			Symbol symbol;
+		};
+
+		static const size_t kMinimalSlotsNumber = 16;
+		static const uint64_t kArchiveTag = 0x48415348;
+
+		static uint64_t Key(uint32_t node, Symbol symbol) {
+			return (uint64_t(node) << 32) | static_cast<typename std::make_unsigned<Symbol>::type>(symbol);
+		}
+
+		size_t Hash(uint64_t key) const {
+			key *= 0x9E3779B97F4A7C15ull;
+			return (key ^ (key >> 32)) & (slots_.size() - 1);
+		}
+
+		void Place(uint64_t key, uint32_t edge) {
+			size_t slot = Hash(key);
+			while (slots_[slot].edge != kNoEdge) {
+				slot = (slot + 1) & (slots_.size() - 1);
+			}
+			slots_[slot].key = key;
+			slots_[slot].edge = edge;
+		}
+
+		void Rehash(size_t slots_number) {
+			size_t power_of_two = kMinimalSlotsNumber;
+			while (power_of_two < slots_number) {
+				power_of_two *= 2;
+			}
+			if (power_of_two <= slots_.size()) {
+				return;
+			}
+
+			FlatArray<Slot> old_slots;
+			old_slots.assign(power_of_two, Slot{0, kNoEdge});
+			old_slots.swap(slots_);
+			for (const Slot& slot : old_slots) {
+				if (slot.edge != kNoEdge) {
+					Place(slot.key, slot.edge);
+				}
+			}
+		}
+
+		FlatArray<Slot> slots_;
+		FlatArray<uint32_t> first_edge_;
+		FlatArray<Sibling> siblings_;
+		size_t size_;
 };
 
-Node * GetNewNode() {
-    Node * new_node = new Node;
+template <class Symbol>
+const size_t HashTransitions<Symbol>::kMinimalSlotsNumber;
+
+// Suffix array of codes by induced sorting (SA-IS) in O(n) time, codes
+// lie in [0, upper_code]. A suffix which is a prefix of another one is
+// smaller, so the codes need no sentinel
+std::vector<uint32_t> InducedSortSuffixes(const std::vector<uint32_t>& codes, uint32_t upper_code) {
+	size_t length = codes.size();
+	if (length == 0) {
+		return std::vector<uint32_t>();
+	}
+	if (length == 1) {
+		return std::vector<uint32_t>(1, 0);
+	}
+	if (length == 2) {
+		return codes[0] < codes[1] ? std::vector<uint32_t>{0, 1} : std::vector<uint32_t>{1, 0};
+	}
+
+	const uint32_t kEmpty = std::numeric_limits<uint32_t>::max();
+	std::vector<uint32_t> suffix_array(length);
+	// is_smaller[i] tells that suffix i is an S-type one, i.e. less than suffix i + 1
+	std::vector<bool> is_smaller(length, false);
+	for (size_t index = length - 1; index-- > 0; ) {
+		is_smaller[index] = codes[index] == codes[index + 1] ? 
+				is_smaller[index + 1] : codes[index] < codes[index + 1];
+	}
+
+	// Bucket of every code starts with its L-type suffixes, then S-type
+	std::vector<uint32_t> larger_starts(upper_code + 2, 0);
+	std::vector<uint32_t> smaller_starts(upper_code + 2, 0);
+	for (size_t index = 0; index < length; ++index) {
+		if (!is_smaller[index]) {
+			++smaller_starts[codes[index]];
+		} else {
+			++larger_starts[codes[index] + 1];
+		}
+	}
+	for (size_t code = 0; code <= upper_code; ++code) {
+		smaller_starts[code] += larger_starts[code];
+		larger_starts[code + 1] += smaller_starts[code];
+	}
+
+	std::vector<uint32_t> bucket_heads(upper_code + 2);
+	auto induce = [&](const std::vector<uint32_t>& lms_suffixes) {
+		std::fill(suffix_array.begin(), suffix_array.end(), kEmpty);
+		std::copy(smaller_starts.begin(), smaller_starts.end(), bucket_heads.begin());
+		for (uint32_t suffix : lms_suffixes) {
+			suffix_array[bucket_heads[codes[suffix]]++] = suffix;
+		}
 
-    new_node->upper_going_edge = nullptr;     
-    new_node->suffix_link_pointer = nullptr;    
+		std::copy(larger_starts.begin(), larger_starts.end(), bucket_heads.begin());
+		suffix_array[bucket_heads[codes[length - 1]]++] = length - 1;
+		for (size_t index = 0; index < length; ++index) {
+			uint32_t suffix = suffix_array[index];
+			if (suffix != kEmpty && suffix >= 1 && !is_smaller[suffix - 1]) {
+				suffix_array[bucket_heads[codes[suffix - 1]]++] = suffix - 1;
+			}
+		}
+
+		std::copy(larger_starts.begin(), larger_starts.end(), bucket_heads.begin());
+		for (size_t index = length; index-- > 0; ) {
+			uint32_t suffix = suffix_array[index];
+			if (suffix != kEmpty && suffix >= 1 && is_smaller[suffix - 1]) {
+				suffix_array[--bucket_heads[codes[suffix - 1] + 1]] = suffix - 1;
+			}
+		}
+	};
+
+	// Leftmost S-type suffixes, i.e. S-type ones after an L-type one
+	std::vector<uint32_t> lms_ids(length + 1, kEmpty);
+	std::vector<uint32_t> lms_suffixes;
+	for (size_t index = 1; index < length; ++index) {
+		if (!is_smaller[index - 1] && is_smaller[index]) {
+			lms_ids[index] = lms_suffixes.size();
+			lms_suffixes.push_back(index);
+		}
+	}
+
+	induce(lms_suffixes);
+
+	if (!lms_suffixes.empty()) {
+		std::vector<uint32_t> sorted_lms;
+		sorted_lms.reserve(lms_suffixes.size());
+		for (uint32_t suffix : suffix_array) {
+			if (lms_ids[suffix] != kEmpty) {
+				sorted_lms.push_back(suffix);
+			}
+		}
+
+		// Names equal LMS substrings equally and recurses on the names
+		std::vector<uint32_t> reduced_codes(lms_suffixes.size());
+		uint32_t reduced_upper_code = 0;
+		reduced_codes[lms_ids[sorted_lms[0]]] = 0;
+		for (size_t rank = 1; rank < sorted_lms.size(); ++rank) {
+			size_t left = sorted_lms[rank - 1];
+			size_t right = sorted_lms[rank];
+			size_t left_end = lms_ids[left] + 1 < lms_suffixes.size() ? 
+					lms_suffixes[lms_ids[left] + 1] : length;
+			size_t right_end = lms_ids[right] + 1 < lms_suffixes.size() ? 
+					lms_suffixes[lms_ids[right] + 1] : length;
+			bool same = left_end - left == right_end - right;
+			if (same) {
+				while (left < left_end && codes[left] == codes[right]) {
+					++left;
+					++right;
+				}
+				same = left != length && codes[left] == codes[right];
+			}
+			if (!same) {
+				++reduced_upper_code;
+			}
+			reduced_codes[lms_ids[sorted_lms[rank]]] = reduced_upper_code;
+		}
+
+		std::vector<uint32_t> reduced_suffix_array = 
+				InducedSortSuffixes(reduced_codes, reduced_upper_code);
+		for (size_t rank = 0; rank < sorted_lms.size(); ++rank) {
+			sorted_lms[rank] = lms_suffixes[reduced_suffix_array[rank]];
+		}
+		induce(sorted_lms);
+	}
+
+	return suffix_array;
+}
+
+// Kasai's pass over the suffixes starting in [begin, end) of the text.
+// The common prefix drops by at most one from a suffix to the next one,
+// so it is found from scratch only at begin
+template <class Suffixes, class Lcp>
+void ComputeLcpOfSuffixes(const std::vector<uint32_t>& codes, const Suffixes& suffix_array, 
+		const std::vector<uint32_t>& rank, size_t begin, size_t end, Lcp * lcp) {
+	size_t common = 0;
+	for (size_t suffix = begin; suffix < end; ++suffix) {
+		if (rank[suffix] == 0) {
+			common = 0;
+			continue;
+		}
+		size_t previous = suffix_array[rank[suffix] - 1];
+		while (suffix + common < codes.size() && previous + common < codes.size() && 
+				codes[suffix + common] == codes[previous + common]) {
+			++common;
+		}
+		(*lcp)[rank[suffix]] = common;
+		if (common > 0) {
+			--common;
+		}
+	}
+}
+
+// LCP array by Kasai et al. in O(n): lcp[i] is the common prefix of
+// suffixes suffix_array[i - 1] and suffix_array[i], lcp[0] is zero
+template <class Suffixes, class Lcp>
+void ComputeLcp(const std::vector<uint32_t>& codes, const Suffixes& suffix_array, Lcp * lcp) {
+	std::vector<uint32_t> rank(suffix_array.size());
+	for (size_t index = 0; index < suffix_array.size(); ++index) {
+		rank[suffix_array[index]] = index;
+	}
+
+	lcp->assign(suffix_array.size(), 0);
+	ComputeLcpOfSuffixes(codes, suffix_array, rank, 0, suffix_array.size(), lcp);
+}
+
+// Persistent pool for data parallel loops. Every thread owns a contiguous
+// range of indices packed into one atomic word and takes small blocks
+// from its front. A thread which runs out of work steals the back half
+// of the largest range it finds, so skewed batches stay balanced
+class ThreadPool {
+	public:
+		explicit ThreadPool(size_t threads_number = std::thread::hardware_concurrency()) 
+				: ranges_(std::max<size_t>(threads_number, 1)), generation_(0), 
+				  busy_workers_(0), stopping_(false) {
+			for (size_t worker_id = 1; worker_id < ranges_.size(); ++worker_id) {
+				workers_.emplace_back([this, worker_id] { WorkerLoop(worker_id); });
+			}
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		~ThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stopping_ = true;
+			}
+			start_condition_.notify_all();
+			for (std::thread& worker : workers_) {
+				worker.join();
+			}
+		}
+
+		size_t ThreadsNumber() const {
+			return ranges_.size();
+		}
+
+		// Calls task(index) for every index in [0, size) and returns once
+		// all of them are done. The calling thread works as well
+		template <class Task>
+		void ParallelFor(size_t size, Task task) {
+			if (size > std::numeric_limits<uint32_t>::max()) {
+				throw std::length_error("parallel loop is too long for 32-bit ranges");
+			}
+
+			std::unique_lock<std::mutex> lock(mutex_);
+			task_ = [&task](size_t begin, size_t end) {
+				for (size_t index = begin; index < end; ++index) {
+					task(index);
+				}
+			};
+			for (size_t worker_id = 0; worker_id < ranges_.size(); ++worker_id) {
+				ranges_[worker_id].bounds.store(Pack(size * worker_id / ranges_.size(), 
+						size * (worker_id + 1) / ranges_.size()));
+			}
+			unfinished_ = size;
+			busy_workers_ = workers_.size();
+			++generation_;
+			lock.unlock();
+			start_condition_.notify_all();
+
+			RunTasks(0);
+
+			lock.lock();
+			finish_condition_.wait(lock, [this] { return busy_workers_ == 0; });
+			task_ = nullptr;
+		}
+
+	private:
+		static const size_t kBlockSize = 64;
+
+		struct alignas(64) Range {
+			std::atomic<uint64_t> bounds;
+		};
+
+		static uint64_t Pack(uint64_t begin, uint64_t end) {
+			return (begin << 32) | end;
+		}
+
+		static uint64_t Begin(uint64_t bounds) {
+			return bounds >> 32;
+		}
+
+		static uint64_t End(uint64_t bounds) {
+			return bounds & std::numeric_limits<uint32_t>::max();
+		}
+
+		void WorkerLoop(size_t worker_id) {
+			size_t seen_generation = 0;
+			while (true) {
+				std::unique_lock<std::mutex> lock(mutex_);
+				start_condition_.wait(lock, [this, seen_generation] { 
+					return stopping_ || generation_ != seen_generation; 
+				});
+				if (stopping_) {
+					return;
+				}
+				seen_generation = generation_;
+				lock.unlock();
+
+				RunTasks(worker_id);
+
+				lock.lock();
+				if (--busy_workers_ == 0) {
+					finish_condition_.notify_all();
+				}
+			}
+		}
+
+		void RunTasks(size_t worker_id) {
+			std::atomic<uint64_t>& own_bounds = ranges_[worker_id].bounds;
+			while (unfinished_.load() > 0) {
+				uint64_t bounds = own_bounds.load();
+				if (Begin(bounds) < End(bounds)) {
+					uint64_t block_end = std::min(Begin(bounds) + kBlockSize, End(bounds));
+					if (own_bounds.compare_exchange_weak(bounds, Pack(block_end, End(bounds)))) {
+						task_(Begin(bounds), block_end);
+						unfinished_ -= block_end - Begin(bounds);
+					}
+				} else if (!Steal(worker_id)) {
+					std::this_thread::yield();
+				}
+			}
+		}
+
+		bool Steal(size_t thief_id) {
+			size_t victim_id = thief_id;
+			uint64_t victim_bounds = 0;
+			for (size_t worker_id = 0; worker_id < ranges_.size(); ++worker_id) {
+				uint64_t bounds = ranges_[worker_id].bounds.load();
+				if (End(bounds) > Begin(bounds) && 
+						End(bounds) - Begin(bounds) > End(victim_bounds) - Begin(victim_bounds)) {
+					victim_id = worker_id;
+					victim_bounds = bounds;
+				}
+			}
+			if (victim_id == thief_id || End(victim_bounds) - Begin(victim_bounds) < 2) {
+				return false;
+			}
+
+			uint64_t middle = Begin(victim_bounds) + (End(victim_bounds) - Begin(victim_bounds)) / 2;
+			if (!ranges_[victim_id].bounds.compare_exchange_strong(victim_bounds, 
+					Pack(Begin(victim_bounds), middle))) {
+				return false;
+			}
+			ranges_[thief_id].bounds.store(Pack(middle, End(victim_bounds)));
+			return true;
+		}
+
+		std::vector<Range> ranges_;
+		std::vector<std::thread> workers_;
+		std::function<void(size_t, size_t)> task_;
+		std::atomic<size_t> unfinished_;
+		std::mutex mutex_;
+		std::condition_variable start_condition_;
+		std::condition_variable finish_condition_;
+		size_t generation_;
+		size_t busy_workers_;
+		bool stopping_;
+};
+
+// A range [begin, end) of the suffix array whose suffixes are still equal
+// in the prefix sorted so far
+struct SuffixGroup {
+	uint32_t begin;
+	uint32_t end;
+};
+
+// Sorts the suffixes of every group by key_at(suffix) and splits the
+// group by the keys, giving every suffix the rank 1 + the start of its new
+// group. Ranks are written after all groups are sorted, so key_at may read
+// the ranks of the previous round. Groups are cut into chunks of about
+// the same number of suffixes, which the pool sorts independently
+template <class Key, class KeyAt>
+void SortSuffixGroups(const std::vector<SuffixGroup>& groups, KeyAt key_at, 
+		std::vector<uint32_t> * suffix_array, std::vector<uint32_t> * rank, 
+		std::vector<SuffixGroup> * unsorted_groups, ThreadPool * pool) {
+	const size_t kChunksPerThread = 8;
+	size_t suffixes_number = 0;
+	for (const SuffixGroup& group : groups) {
+		suffixes_number += group.end - group.begin;
+	}
+	size_t chunk_size = std::max<size_t>(suffixes_number / (kChunksPerThread * pool->ThreadsNumber()), 1);
+	std::vector<size_t> chunk_starts(1, 0);
+	size_t chunk_suffixes = 0;
+	for (size_t group = 0; group < groups.size(); ++group) {
+		chunk_suffixes += groups[group].end - groups[group].begin;
+		if (chunk_suffixes >= chunk_size && group + 1 < groups.size()) {
+			chunk_starts.push_back(group + 1);
+			chunk_suffixes = 0;
+		}
+	}
+	chunk_starts.push_back(groups.size());
+	size_t chunks_number = chunk_starts.size() - 1;
+
+	std::vector<uint32_t> group_ranks(suffixes_number);
+	std::vector<size_t> chunk_offsets(chunks_number + 1, 0);
+	for (size_t chunk = 0; chunk < chunks_number; ++chunk) {
+		chunk_offsets[chunk + 1] = chunk_offsets[chunk];
+		for (size_t group = chunk_starts[chunk]; group < chunk_starts[chunk + 1]; ++group) {
+			chunk_offsets[chunk + 1] += groups[group].end - groups[group].begin;
+		}
+	}
+
+	std::vector<std::vector<SuffixGroup>> chunk_unsorted_groups(chunks_number);
+	pool->ParallelFor(chunks_number, [&](size_t chunk) {
+		std::vector<std::pair<Key, uint32_t>> keyed_suffixes;
+		uint32_t * ranks = group_ranks.data() + chunk_offsets[chunk];
+		for (size_t group = chunk_starts[chunk]; group < chunk_starts[chunk + 1]; ++group) {
+			uint32_t begin = groups[group].begin;
+			uint32_t end = groups[group].end;
+			keyed_suffixes.clear();
+			for (uint32_t index = begin; index < end; ++index) {
+				keyed_suffixes.push_back(std::make_pair(key_at((*suffix_array)[index]), (*suffix_array)[index]));
+			}
+			std::sort(keyed_suffixes.begin(), keyed_suffixes.end());
+
+			uint32_t subgroup_begin = begin;
+			for (uint32_t index = begin; index < end; ++index) {
+				if (index > begin && keyed_suffixes[index - begin].first != keyed_suffixes[index - begin - 1].first) {
+					if (index - subgroup_begin > 1) {
+						chunk_unsorted_groups[chunk].push_back(SuffixGroup{subgroup_begin, index});
+					}
+					subgroup_begin = index;
+				}
+				(*suffix_array)[index] = keyed_suffixes[index - begin].second;
+				*ranks++ = subgroup_begin + 1;
+			}
+			if (end - subgroup_begin > 1) {
+				chunk_unsorted_groups[chunk].push_back(SuffixGroup{subgroup_begin, end});
+			}
+		}
+	});
+
+	pool->ParallelFor(chunks_number, [&](size_t chunk) {
+		const uint32_t * ranks = group_ranks.data() + chunk_offsets[chunk];
+		for (size_t group = chunk_starts[chunk]; group < chunk_starts[chunk + 1]; ++group) {
+			for (uint32_t index = groups[group].begin; index < groups[group].end; ++index) {
+				(*rank)[(*suffix_array)[index]] = *ranks++;
+			}
+		}
+	});
+
+	unsorted_groups->clear();
+	for (const std::vector<SuffixGroup>& chunk_groups : chunk_unsorted_groups) {
+		unsorted_groups->insert(unsorted_groups->end(), chunk_groups.begin(), chunk_groups.end());
+	}
+}
+
+// Suffix array of the same codes as InducedSortSuffixes, built on the
+// pool. Suffixes are bucketed by their first code and every bucket is
+// sorted by as many leading codes as fit into 64 bits. Groups still tied
+// are then refined by prefix doubling: sorting a group by the ranks of
+// the suffixes h codes further sorts it by 2h codes. Every round sorts
+// the unsorted groups independently, so the work is spread over the pool.
+// Long repeats keep large groups through many rounds, so SA-IS is used
+// instead when a sample of the packed prefixes is mostly tied, once a
+// round would sort more than half of the text or once the rounds have
+// sorted kMaxDoublingWork times the text, as it is for a pool of one
+// thread
+std::vector<uint32_t> SortSuffixesInParallel(const std::vector<uint32_t>& codes, uint32_t upper_code, 
+		ThreadPool * pool) {
+	const size_t kMaxDoublingWork = 2;
+	const size_t kBlockSize = 1 << 16;
+	size_t length = codes.size();
+	if (pool->ThreadsNumber() == 1 || length < 2) {
+		return InducedSortSuffixes(codes, upper_code);
+	}
+
+	// Codes are shifted by one, so a prefix running out of the text is
+	// smaller than any prefix of the same length which does not
+	size_t code_bits = 1;
+	while (code_bits < 64 && (uint64_t(upper_code) + 1) >> code_bits != 0) {
+		++code_bits;
+	}
+	const size_t packed_codes = std::max<size_t>(64 / code_bits, 1);
+	size_t blocks_number = (length + kBlockSize - 1) / kBlockSize;
+	std::vector<uint64_t> packed_prefixes(length);
+	pool->ParallelFor(blocks_number, [&](size_t block) {
+		for (size_t suffix = block * kBlockSize; suffix < std::min(length, (block + 1) * kBlockSize); ++suffix) {
+			uint64_t packed = 0;
+			for (size_t offset = 0; offset < packed_codes; ++offset) {
+				packed <<= code_bits;
+				if (suffix + offset < length) {
+					packed |= uint64_t(codes[suffix + offset]) + 1;
+				}
+			}
+			packed_prefixes[suffix] = packed;
+		}
+	});
+
+	// A text whose leading codes mostly repeat, such as a long periodic
+	// run, would leave most suffixes tied for many rounds. A random sample
+	// of the prefixes shows it before any sorting
+	const size_t kSampleSize = 1 << 12;
+	if (length > kSampleSize) {
+		std::minstd_rand generator(length);
+		std::vector<uint64_t> sample(kSampleSize);
+		for (uint64_t& prefix : sample) {
+			prefix = packed_prefixes[generator() % length];
+		}
+		std::sort(sample.begin(), sample.end());
+		size_t tied_number = 0;
+		for (size_t index = 0; index < kSampleSize; ++index) {
+			if ((index > 0 && sample[index] == sample[index - 1]) || 
+					(index + 1 < kSampleSize && sample[index] == sample[index + 1])) {
+				++tied_number;
+			}
+		}
+		if (2 * tied_number > kSampleSize) {
+			return InducedSortSuffixes(codes, upper_code);
+		}
+	}
+
+	// Buckets by the first code, by counting
+	std::vector<uint32_t> bucket_starts(size_t(upper_code) + 2, 0);
+	for (uint32_t code : codes) {
+		++bucket_starts[code + 1];
+	}
+	for (size_t code = 0; code <= upper_code; ++code) {
+		bucket_starts[code + 1] += bucket_starts[code];
+	}
+	std::vector<uint32_t> suffix_array(length);
+	std::vector<uint32_t> rank(length);
+	{
+		std::vector<uint32_t> bucket_ends(bucket_starts.begin(), bucket_starts.end() - 1);
+		for (size_t suffix = 0; suffix < length; ++suffix) {
+			suffix_array[bucket_ends[codes[suffix]]++] = suffix;
+		}
+	}
+	std::vector<SuffixGroup> groups;
+	for (size_t code = 0; code <= upper_code; ++code) {
+		if (bucket_starts[code + 1] - bucket_starts[code] > 1) {
+			groups.push_back(SuffixGroup{bucket_starts[code], bucket_starts[code + 1]});
+		} else if (bucket_starts[code + 1] - bucket_starts[code] == 1) {
+			rank[suffix_array[bucket_starts[code]]] = bucket_starts[code] + 1;
+		}
+	}
+
+	std::vector<SuffixGroup> unsorted_groups;
+	SortSuffixGroups<uint64_t>(groups, [&packed_prefixes](uint32_t suffix) { return packed_prefixes[suffix]; }, 
+			&suffix_array, &rank, &unsorted_groups, pool);
+	std::vector<uint64_t>().swap(packed_prefixes);
+
+	size_t sorted_prefix = packed_codes;
+	size_t doubling_work = 0;
+	while (!unsorted_groups.empty()) {
+		groups.swap(unsorted_groups);
+		size_t round_work = 0;
+		for (const SuffixGroup& group : groups) {
+			round_work += group.end - group.begin;
+		}
+		doubling_work += round_work;
+		if (2 * round_work > length || doubling_work > kMaxDoublingWork * length) {
+			return InducedSortSuffixes(codes, upper_code);
+		}
+
+		SortSuffixGroups<uint32_t>(groups, [&rank, length, sorted_prefix](uint32_t suffix) { 
+					return suffix + sorted_prefix < length ? rank[suffix + sorted_prefix] : 0; 
+				}, &suffix_array, &rank, &unsorted_groups, pool);
+		sorted_prefix *= 2;
+	}
+
+	return suffix_array;
+}
+
+// ComputeLcp on the pool. Kasai's pass is split into ranges of text
+// positions, each restarting from a zero common prefix, so a range costs
+// its length plus the largest common prefix
+template <class Suffixes, class Lcp>
+void ComputeLcpInParallel(const std::vector<uint32_t>& codes, const Suffixes& suffix_array, Lcp * lcp, 
+		ThreadPool * pool) {
+	const size_t kRangesPerThread = 4;
+	const size_t kMinRangeLength = 1 << 16;
+	size_t length = suffix_array.size();
+	size_t ranges_number = std::max<size_t>(1, std::min(kRangesPerThread * pool->ThreadsNumber(), 
+			length / kMinRangeLength));
+
+	std::vector<uint32_t> rank(length);
+	pool->ParallelFor(ranges_number, [&](size_t range) {
+		for (size_t index = length * range / ranges_number; index < length * (range + 1) / ranges_number; ++index) {
+			rank[suffix_array[index]] = index;
+		}
+	});
+
+	lcp->assign(length, 0);
+	pool->ParallelFor(ranges_number, [&](size_t range) {
+		ComputeLcpOfSuffixes(codes, suffix_array, rank, length * range / ranges_number, 
+				length * (range + 1) / ranges_number, lcp);
+	});
+}
+
+// Counters of the work done by Ukkonen's algorithm, which should stay
+// linear in the text length
+struct ConstructionStatistics {
+	size_t steps_made;
+	size_t suffix_links_used;
+	size_t nodes;
+	size_t edges;
+	size_t leaves;
+	size_t text_length;
+};
+
+// Substring of the concatenated documents, DocumentOf(position) tells
+// which document it is taken from
+struct Substring {
+	size_t position;
+	size_t length;
+};
+
+// Symbol is the alphabet: char, unsigned char for raw bytes or an
+// integer token type. Transitions is one of the policies above and is
+// picked by the alphabet: DenseTransitions for small ones,
+// SortedTransitions for sparse nodes and HashTransitions for large ones
+template <class Symbol = char, class Transitions = DenseTransitions<Symbol>>
+class SuffixTree {
+	public:
+		SuffixTree() {
+			Clear();
+		}
+
+		// Sequence is any container of symbols convertible to Symbol,
+		// e.g. std::string for ByteSuffixTree
+		template <class Sequence>
+		bool IfSuffix(const Sequence& prefix_candidate) const {
+			return FindLocus(prefix_candidate) != kNoNode;
+		}
+
+		// Number of occurrences in O(|pattern|). The first call after an
+		// Append refreshes the leaf counts, see UpdateLeafCounts
+		template <class Sequence>
+		size_t Count(const Sequence& pattern) const {
+			uint32_t locus = FindLocus(pattern);
+			if (locus == kNoNode) {
+				return 0;
+			}
+			UpdateLeafCounts();
+
+			return leaf_counts_[locus];
+		}
+
+		// Calls on_match(position) for the start of every occurrence, in
+		// no particular order. Walks the subtree without a stack, so it
+		// allocates nothing and costs O(|pattern| + subtree size)
+		template <class Sequence, class Callback>
+		void Locate(const Sequence& pattern, Callback on_match) const {
+			uint32_t locus = FindLocus(pattern);
+			if (locus == kNoNode) {
+				return;
+			}
+
+			struct LeafReporter {
+				const SuffixTree& tree;
+				Callback& on_match;
+
+				void EnterNode(uint32_t node, uint32_t /*depth*/) {
+					if (tree.IsLeaf(node)) {
+						on_match(tree.nodes_[node].suffix_start);
+					}
+				}
+
+				void LeaveNode(uint32_t /*node*/, uint32_t /*depth*/) {
+				}
+			};
+			LeafReporter reporter{*this, on_match};
+			TraverseDepthFirst(locus, reporter);
+		}
+
+		// Suffix array and LCP array of the whole text by a lexicographic
+		// depth-first search. Terminators sort before every symbol, and
+		// suffixes which differ only in their terminators are ordered by
+		// document. lcp[i] is the common prefix of suffixes i - 1 and i
+		void ToSuffixArray(std::vector<uint32_t> * suffix_array, std::vector<uint32_t> * lcp) const {
+			suffix_array->clear();
+			lcp->clear();
+			suffix_array->reserve(base_string_.size());
+			lcp->reserve(base_string_.size());
+
+			// The common prefix of two neighbouring leaves is the depth of
+			// the parent of the first node entered after the earlier leaf
+			struct SuffixCollector {
+				const SuffixTree& tree;
+				std::vector<uint32_t> * suffix_array;
+				std::vector<uint32_t> * lcp;
+				uint32_t common_depth;
+
+				void EnterNode(uint32_t node, uint32_t depth) {
+					if (node == kRootNode) {
+						return;
+					}
+					uint32_t parent_depth = depth - tree.EdgeLength(tree.nodes_[node].upper_going_edge);
+					common_depth = std::min(common_depth, parent_depth);
+					if (tree.IsLeaf(node)) {
+						suffix_array->push_back(tree.nodes_[node].suffix_start);
+						lcp->push_back(common_depth);
+						common_depth = std::numeric_limits<uint32_t>::max();
+					}
+				}
+
+				void LeaveNode(uint32_t /*node*/, uint32_t /*depth*/) {
+				}
+			};
+			SuffixCollector collector{*this, suffix_array, lcp, 0};
+			TraverseInOrder(collector);
+		}
+
+		// Longest substring occurring at least twice, in one document or in
+		// different ones. It spells the deepest inner node, so one traversal
+		// finds it in O(tree size). The length is zero if nothing repeats
+		Substring LongestRepeatedSubstring() const {
+			struct DeepestNodeFinder {
+				const SuffixTree& tree;
+				uint32_t deepest_node;
+				uint32_t deepest_depth;
+
+				void EnterNode(uint32_t node, uint32_t depth) {
+					if (!tree.IsLeaf(node) && depth > deepest_depth) {
+						deepest_node = node;
+						deepest_depth = depth;
+					}
+				}
+
+				void LeaveNode(uint32_t /*node*/, uint32_t /*depth*/) {
+				}
+			};
+			DeepestNodeFinder finder{*this, kRootNode, 0};
+			TraverseDepthFirst(kRootNode, finder);
+			if (finder.deepest_node == kRootNode) {
+				return Substring{0, 0};
+			}
+
+			return Substring{AnySuffixBelow(finder.deepest_node), finder.deepest_depth};
+		}
+
+		// Longest substring occurring in every document
+		Substring LongestCommonSubstring() const {
+			return LongestCommonSubstring(DocumentsNumber());
+		}
+
+		// Longest substring occurring in at least min_documents different
+		// documents. Slides a window over the suffix array which holds
+		// suffixes of min_documents documents and keeps the minimum of its
+		// LCP values in a monotone deque, so it costs O(|S|) on top of
+		// ToSuffixArray. The length is zero if there is no such substring
+		Substring LongestCommonSubstring(size_t min_documents) const {
+			if (min_documents < 2 || min_documents > DocumentsNumber()) {
+				throw std::invalid_argument("common substring needs from two to all documents");
+			}
+
+			std::vector<uint32_t> suffix_array;
+			std::vector<uint32_t> lcp;
+			ToSuffixArray(&suffix_array, &lcp);
+			std::vector<uint32_t> position_documents(base_string_.size());
+			for (size_t document = 0; document < document_starts_.size(); ++document) {
+				size_t document_end = document + 1 < document_starts_.size() ? 
+						document_starts_[document + 1] : base_string_.size();
+				std::fill(position_documents.begin() + document_starts_[document], 
+						position_documents.begin() + document_end, document);
+			}
+
+			Substring longest{0, 0};
+			std::vector<uint32_t> window_suffixes(document_starts_.size(), 0);
+			size_t window_documents = 0;
+			// Indices of lcp in (window_begin, window_end] with increasing values
+			std::deque<size_t> lcp_minimums;
+			size_t window_begin = 0;
+			for (size_t window_end = 0; window_end < suffix_array.size(); ++window_end) {
+				if (window_end > window_begin) {
+					while (!lcp_minimums.empty() && lcp[lcp_minimums.back()] >= lcp[window_end]) {
+						lcp_minimums.pop_back();
+					}
+					lcp_minimums.push_back(window_end);
+				}
+				if (window_suffixes[position_documents[suffix_array[window_end]]]++ == 0) {
+					++window_documents;
+				}
+
+				while (window_begin < window_end) {
+					uint32_t& first_document_suffixes = 
+							window_suffixes[position_documents[suffix_array[window_begin]]];
+					if (first_document_suffixes == 1 && window_documents <= min_documents) {
+						break;
+					}
+					if (--first_document_suffixes == 0) {
+						--window_documents;
+					}
+					++window_begin;
+					while (!lcp_minimums.empty() && lcp_minimums.front() <= window_begin) {
+						lcp_minimums.pop_front();
+					}
+				}
+
+				if (window_documents >= min_documents && !lcp_minimums.empty() && 
+						lcp[lcp_minimums.front()] > longest.length) {
+					longest = Substring{suffix_array[window_end], lcp[lcp_minimums.front()]};
+				}
+			}
+
+			return longest;
+		}
+
+		// statistics[i] is the length of the longest prefix of query[i..]
+		// which occurs in the text. After a mismatch the match drops its
+		// first symbol by a suffix link instead of starting over, which
+		// makes it O(|query|) amortized like Ukkonen's algorithm itself
+		template <class Sequence>
+		void MatchingStatistics(const Sequence& query, std::vector<uint32_t> * statistics) const {
+			statistics->assign(query.size(), 0);
+			// query[start, start + length) is matched and node is the deepest
+			// node on its path, node_depth symbols below the root
+			uint32_t node = kRootNode;
+			size_t node_depth = 0;
+			size_t length = 0;
+			for (size_t start = 0; start < query.size(); ++start) {
+				while (start + length < query.size()) {
+					uint32_t edge = DownEdgeBySymbol(node, Symbol(query[start + node_depth]));
+					if (edge == kNoEdge) {
+						break;
+					}
+
+					size_t edge_index = edges_[edge].left_substring_bound + length - node_depth;
+					size_t edge_end = MatchableRightBound(edge);
+					while (start + length < query.size() && edge_index < edge_end && 
+							base_string_[edge_index] == Symbol(query[start + length])) {
+						++edge_index;
+						++length;
+					}
+					if (edge_index < edges_[edge].right_substring_bound) {
+						break;
+					}
+					node = edges_[edge].lower_node;
+					node_depth = length;
+				}
+				(*statistics)[start] = length;
+
+				if (length == 0) {
+					continue;
+				}
+				--length;
+				if (node != kRootNode) {
+					node = nodes_[node].suffix_link;
+					--node_depth;
+				}
+				// Edges fully covered by the rest of the match are skipped
+				// by their lengths without comparing symbols
+				while (length > node_depth) {
+					uint32_t edge = DownEdgeBySymbol(node, Symbol(query[start + 1 + node_depth]));
+					if (node_depth + EdgeLength(edge) > length) {
+						break;
+					}
+					node_depth += EdgeLength(edge);
+					node = edges_[edge].lower_node;
+				}
+			}
+		}
+
+		// Counts are kept in a separate array which is rebuilt here in
+		// O(tree size) if the tree has grown. Call it after appending and
+		// before sharing the tree between threads, since Count refreshes
+		// stale counts by itself. Every Append adds nodes, so a size
+		// mismatch is enough to detect stale counts
+		void UpdateLeafCounts() const {
+			if (leaf_counts_.size() == nodes_.size()) {
+				return;
+			}
+
+			// A node is left after all of its children, so its count is
+			// final by then and can be added to the parent
+			struct LeafCounter {
+				const SuffixTree& tree;
+
+				void EnterNode(uint32_t node, uint32_t /*depth*/) {
+					tree.leaf_counts_[node] = tree.IsLeaf(node) ? 1 : 0;
+				}
+
+				void LeaveNode(uint32_t node, uint32_t /*depth*/) {
+					if (node != kRootNode) {
+						uint32_t parent = tree.edges_[tree.nodes_[node].upper_going_edge].upper_node;
+						tree.leaf_counts_[parent] += tree.leaf_counts_[node];
+					}
+				}
+			};
+			leaf_counts_.resize(nodes_.size());
+			LeafCounter counter{*this};
+			TraverseDepthFirst(kRootNode, counter);
+		}
+
+		template <class Sequence>
+		void Initialize(const Sequence& input_string) {
+			Initialize(std::begin(input_string), std::end(input_string));
+		}
+
+		template <class Iterator>
+		void Initialize(Iterator begin, Iterator end) {
+			Clear();
+			Append(begin, end);
+		}
+
+		// Builds the same tree as appending the documents one by one, but
+		// bottom-up from the suffix array instead of by Ukkonen's phases.
+		// Suffixes are partitioned by their first symbols into runs of the
+		// suffix array, the subtree of every run is built and linked on
+		// its own thread, and a short sequential pass joins the subtrees
+		// under the root. The suffix array and LCP array are built on the
+		// pool too, see SortSuffixesInParallel. The tree can be appended to
+		// afterwards
+		template <class Sequence>
+		void InitializeInParallel(const std::vector<Sequence>& documents, ThreadPool * pool) {
+			Clear();
+			for (const Sequence& document : documents) {
+				document_starts_.push_back(base_string_.size());
+				base_string_.append(std::begin(document), std::end(document));
+				if (base_string_.size() + 1 > kMaxStringLength) {
+					Clear();
+					throw std::length_error("string is too long for 32-bit suffix tree indices");
+				}
+				if (!AcceptsSymbols(document_starts_.back())) {
+					Clear();
+					throw std::invalid_argument("symbol is outside of the alphabet of the transitions");
+				}
+				base_string_.push_back(Symbol());
+			}
+			if (base_string_.empty()) {
+				return;
+			}
+
+			std::vector<uint32_t> suffix_array;
+			std::vector<uint32_t> lcp;
+			{
+				std::vector<uint32_t> codes;
+				uint32_t upper_code = EncodeDocuments(&codes);
+				suffix_array = SortSuffixesInParallel(codes, upper_code, pool);
+				ComputeLcpInParallel(codes, suffix_array, &lcp, pool);
+			}
+			BuildFromSuffixArray(suffix_array, lcp, pool);
+		}
+
+		void Clear() {
+			base_string_.clear();
+			document_starts_.clear();
+			mapped_file_.reset();
+			steps_made_ = 0;
+			sl_created_ = 0;
+
+			nodes_.clear();
+			edges_.clear();
+			leaf_counts_.clear();
+			transitions_.Clear();
+			GetNewNode();
+
+			current_node_ = kRootNode;
+			explicit_start_phase_ = true;
+			current_edge_ = kNoEdge;
+			current_edge_position_ = 0;
+			unlinked_node_ = kNoNode;
+			leaves_number_ = 0;
+		}
+
+		// Extends the tree online with one more document followed by its own
+		// terminator. Costs O(|document|) amortized and returns document id
+		template <class Sequence>
+		size_t Append(const Sequence& document) {
+			return Append(std::begin(document), std::end(document));
+		}
+
+		template <class Iterator>
+		size_t Append(Iterator begin, Iterator end) {
+			DetachArchive detach_archive;
+			Serialize(detach_archive);
+			mapped_file_.reset();
+
+			size_t document_start = base_string_.size();
+			base_string_.append(begin, end);
+			if (base_string_.size() + 1 > kMaxStringLength) {
+				base_string_.resize(document_start);
+				throw std::length_error("string is too long for 32-bit suffix tree indices");
+			}
+			// Checked before the first phase, as a rejected symbol would
+			// leave the tree half extended
+			if (!AcceptsSymbols(document_start)) {
+				base_string_.resize(document_start);
+				throw std::invalid_argument("symbol is outside of the alphabet of the transitions");
+			}
+			// The terminator only needs a position, its value is never compared
+			base_string_.push_back(Symbol());
+			document_starts_.push_back(document_start);
+			ReserveArenas();
+
+			// Terminators are unique, so the previous document left the active
+			// point at the root and its leaves end at its own terminator
+			for (size_t phase_id = document_start; phase_id < base_string_.size(); ++phase_id) {
+				right_bound_ = phase_id;
+				ProcessPhase(phase_id, phase_id + 1 == base_string_.size());
+			}
+
+			return document_starts_.size() - 1;
+		}
+
+		size_t DocumentsNumber() const {
+			return document_starts_.size();
+		}
+
+		// Id of the document which owns the given position of the
+		// concatenated text, e.g. the suffix_start of a leaf
+		size_t DocumentOf(size_t position) const {
+			return std::upper_bound(document_starts_.begin(), document_starts_.end(), position) - 
+					document_starts_.begin() - 1;
+		}
+
+		void PrintTree() const {
+			struct NodePrinter {
+				const SuffixTree& tree;
+
+				void EnterNode(uint32_t node, uint32_t /*depth*/) {
+					tree.PrintNode(node);
+				}
+
+				void LeaveNode(uint32_t /*node*/, uint32_t /*depth*/) {
+				}
+			};
+			NodePrinter printer{*this};
+			TraverseDepthFirst(kRootNode, printer);
+		}
+
+		ConstructionStatistics Statistics() const {
+			ConstructionStatistics statistics;
+			statistics.steps_made = steps_made_;
+			statistics.suffix_links_used = sl_created_;
+			statistics.nodes = nodes_.size();
+			statistics.edges = edges_.size();
+			statistics.leaves = leaves_number_;
+			statistics.text_length = base_string_.size();
+			return statistics;
+		}
+
+		// Writes the node, edge and transition arrays together with the
+		// text, so Load can query them without rebuilding
+		void Save(const std::string& path) const {
+			UpdateLeafCounts();
+			FileWriteArchive archive(path);
+			// Serialize is shared with the reading archives, the writer
+			// only reads the members it is given
+			const_cast<SuffixTree *>(this)->Serialize(archive);
+			archive.Finish();
+		}
+
+		// Maps a file written by Save in O(1): the arrays are used in place
+		// and paged in on demand. Appending to a loaded tree copies them.
+		// A rejected or truncated file leaves the tree as it was
+		void Load(const std::string& path) {
+			SuffixTree loaded;
+			MappedReadArchive archive(path);
+			loaded.Serialize(archive);
+			loaded.mapped_file_ = archive.File();
+			*this = std::move(loaded);
+		}
+
+	private:
+		static const uint32_t kRootNode = 0;
+		static const uint64_t kArchiveMagic = 0x5355464654524545;
+		// Version 2 links every inner node, see unlinked_node_
+		static const uint64_t kArchiveVersion = 2;
+
+		// Whether the transitions can store every symbol of the text from
+		// the given position on
+		bool AcceptsSymbols(size_t start) const {
+			for (size_t position = start; position < base_string_.size(); ++position) {
+				if (!Transitions::Accepts(base_string_[position])) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		template <class Archive>
+		void Serialize(Archive& archive) {
+			CheckArchiveTag(archive, kArchiveMagic);
+			CheckArchiveTag(archive, kArchiveVersion);
+			CheckArchiveTag(archive, sizeof(Symbol));
+			CheckArchiveTag(archive, sizeof(Node));
+			CheckArchiveTag(archive, sizeof(Edge));
+			archive.Array(nodes_);
+			archive.Array(edges_);
+			archive.Array(base_string_);
+			archive.Array(document_starts_);
+			archive.Array(leaf_counts_);
+			transitions_.Serialize(archive);
+
+			archive.Value(steps_made_);
+			archive.Value(sl_created_);
+			archive.Value(current_node_);
+			archive.Value(explicit_start_phase_);
+			archive.Value(current_edge_);
+			archive.Value(current_edge_position_);
+			archive.Value(right_bound_);
+			archive.Value(leaves_number_);
+		}
+
+		// Returns the node at or right below the end of the pattern path,
+		// or kNoNode if the pattern does not occur
+		template <class Sequence>
+		uint32_t FindLocus(const Sequence& prefix_candidate) const {
+			uint32_t walking_node = kRootNode;
+			size_t prefix_index = 0;
+			while (prefix_index < prefix_candidate.size()) {
+				uint32_t down_edge = DownEdgeBySymbol(walking_node, Symbol(prefix_candidate[prefix_index]));
+				if (down_edge == kNoEdge) {
+					return kNoNode;
+				}
+
+				const Edge& leading_edge = edges_[down_edge];
+				size_t edge_index = leading_edge.left_substring_bound;
+				size_t edge_end = MatchableRightBound(down_edge);
+				while (prefix_index < prefix_candidate.size()) {
+					if (edge_index == edge_end || 
+							base_string_[edge_index] != Symbol(prefix_candidate[prefix_index])) {
+						return kNoNode;
+					}
+					++edge_index;
+					++prefix_index;
+					if (edge_index == leading_edge.right_substring_bound) {
+						break;
+					}
+				}
+				walking_node = leading_edge.lower_node;
+			}
+
+			return walking_node;
+		}
+
+		// Children of a node: terminal edges first, then the transitions
+		uint32_t FirstChildEdge(uint32_t node) const {
+			uint32_t terminal_edge = FirstTerminalEdge(node);
+			if (terminal_edge != kNoEdge || IsLeaf(node)) {
+				return terminal_edge;
+			}
+
+			return transitions_.FirstEdge(node);
+		}
+
+		uint32_t NextChildEdge(uint32_t edge) const {
+			uint32_t parent = edges_[edge].upper_node;
+			if (IsTerminalEdge(edge)) {
+				uint32_t terminal_edge = NextTerminalEdge(edge);
+				return terminal_edge != kNoEdge ? terminal_edge : transitions_.FirstEdge(parent);
+			}
+
+			return transitions_.NextEdge(parent, base_string_[edges_[edge].left_substring_bound], edge);
+		}
+
+		// Longest common prefix of suffixes in one run of the suffix array
+		// is kept at least this long while looking for enough runs
+		static const uint32_t kMaxPartitionDepth = 16;
+		// Runs per thread, work stealing evens out their sizes
+		static const size_t kRunsPerThread = 16;
+
+		// Root of a subtree built bottom-up with its string depth and the
+		// start of some suffix below it, which its upper edge is cut from
+		struct SubtreeTop {
+			uint32_t node;
+			uint32_t depth;
+			uint32_t suffix;
+		};
+
+		// Codes for InducedSortSuffixes. The terminators are distinct and
+		// come first in the order of documents, as in ToSuffixArray
+		uint32_t EncodeDocuments(std::vector<uint32_t> * codes) const {
+			static_assert(sizeof(Symbol) <= sizeof(uint32_t), "symbols must fit into 32-bit codes");
+			uint32_t documents_number = document_starts_.size();
+			std::vector<Symbol> alphabet;
+			if (sizeof(Symbol) > 2) {
+				alphabet.assign(base_string_.begin(), base_string_.end());
+				std::sort(alphabet.begin(), alphabet.end());
+				alphabet.erase(std::unique(alphabet.begin(), alphabet.end()), alphabet.end());
+			}
+
+			codes->resize(base_string_.size());
+			for (uint32_t document = 0; document < documents_number; ++document) {
+				size_t terminator = DocumentEnd(document) - 1;
+				for (size_t position = document_starts_[document]; position < terminator; ++position) {
+					Symbol symbol = base_string_[position];
+					(*codes)[position] = documents_number + (sizeof(Symbol) > 2 ? 
+							std::lower_bound(alphabet.begin(), alphabet.end(), symbol) - alphabet.begin() : 
+							int64_t(symbol) - int64_t(std::numeric_limits<Symbol>::min()));
+				}
+				(*codes)[terminator] = document;
+			}
+
+			if (sizeof(Symbol) > 2) {
+				return documents_number + alphabet.size();
+			}
+			return documents_number + uint32_t(std::numeric_limits<Symbol>::max()) - 
+					uint32_t(std::numeric_limits<Symbol>::min());
+		}
+
+		// End of the document including its terminator
+		size_t DocumentEnd(size_t document) const {
+			return document + 1 < document_starts_.size() ? document_starts_[document + 1] : base_string_.size();
+		}
+
+		// Runs of the suffix array whose suffixes share the first
+		// partition_depth symbols become independent subtrees. Node ids are
+		// given run by run, so every thread knows its range in advance,
+		// and the inner nodes joining the runs come last
+		void BuildFromSuffixArray(const std::vector<uint32_t>& suffix_array, 
+				const std::vector<uint32_t>& lcp, ThreadPool * pool) {
+			std::vector<uint32_t> suffix_ends(base_string_.size());
+			for (size_t document = 0; document < document_starts_.size(); ++document) {
+				std::fill(suffix_ends.begin() + document_starts_[document], 
+						suffix_ends.begin() + DocumentEnd(document), DocumentEnd(document));
+			}
+			auto leaf_depth = [&suffix_array, &suffix_ends](size_t rank) -> uint32_t {
+				return suffix_ends[suffix_array[rank]] - suffix_array[rank];
+			};
+
+			std::vector<size_t> run_starts = PartitionSuffixArray(lcp, kRunsPerThread * pool->ThreadsNumber());
+			run_starts.push_back(suffix_array.size());
+			size_t runs_number = run_starts.size() - 1;
+
+			std::vector<uint32_t> run_first_nodes(runs_number + 1);
+			pool->ParallelFor(runs_number, [&](size_t run) {
+				size_t run_start = run_starts[run];
+				std::vector<uint32_t> depths;
+				run_first_nodes[run + 1] = run_starts[run + 1] - run_start + CountInnerNodes(
+						run_starts[run + 1] - run_start, 
+						[&](size_t index) { return leaf_depth(run_start + index); }, 
+						[&](size_t index) { return lcp[run_start + index]; }, &depths);
+			});
+			run_first_nodes[0] = kRootNode + 1;
+			for (size_t run = 0; run < runs_number; ++run) {
+				run_first_nodes[run + 1] += run_first_nodes[run];
+			}
+
+			nodes_.resize(run_first_nodes[runs_number]);
+			edges_.resize(run_first_nodes[runs_number] - 1);
+
+			// The root goes first among the subtrees joined at the top
+			std::vector<SubtreeTop> run_tops(runs_number + 1);
+			run_tops[0] = SubtreeTop{kRootNode, 0, 0};
+			pool->ParallelFor(runs_number, [&](size_t run) {
+				size_t run_start = run_starts[run];
+				uint32_t next_node = run_first_nodes[run];
+				std::vector<SubtreeTop> stack;
+				run_tops[run + 1] = LinkSubtrees(run_starts[run + 1] - run_start, 
+						[&](size_t index) {
+							uint32_t leaf = next_node++;
+							ResetNode(leaf, suffix_array[run_start + index]);
+							return SubtreeTop{leaf, leaf_depth(run_start + index), suffix_array[run_start + index]};
+						}, 
+						[&](size_t index) { return lcp[run_start + index]; }, &next_node, &stack);
+			});
+
+			auto top_at = [&run_tops](size_t index) { return run_tops[index]; };
+			auto run_lcp_at = [&lcp, &run_starts](size_t index) { 
+				return index == 1 ? 0 : lcp[run_starts[index - 1]]; 
+			};
+			std::vector<uint32_t> depths;
+			uint32_t next_node = run_first_nodes[runs_number];
+			size_t nodes_number = next_node + CountInnerNodes(runs_number + 1, 
+					[&run_tops](size_t index) { return run_tops[index].depth; }, run_lcp_at, &depths);
+			nodes_.resize(nodes_number);
+			edges_.resize(nodes_number - 1);
+			std::vector<SubtreeTop> stack;
+			LinkSubtrees(runs_number + 1, top_at, run_lcp_at, &next_node, &stack);
+
+			transitions_.Reserve(nodes_number);
+			for (size_t node = 1; node < nodes_number; ++node) {
+				transitions_.AddNode();
+			}
+
+			// Terminal lists need the edges of a node in the order of the
+			// suffix array, which is the order of their ids. Only the edges
+			// above the runs go into shared nodes
+			if (Transitions::kConcurrentInserts) {
+				pool->ParallelFor(runs_number, [&](size_t run) {
+					for (uint32_t edge = run_first_nodes[run] - 1; edge + 1 < run_first_nodes[run + 1]; ++edge) {
+						if (edge + 1 != run_tops[run + 1].node) {
+							AppendEdgeToNodeDown(edges_[edge].upper_node, edge);
+						}
+					}
+				});
+				for (size_t run = 1; run <= runs_number; ++run) {
+					uint32_t edge = run_tops[run].node - 1;
+					AppendEdgeToNodeDown(edges_[edge].upper_node, edge);
+				}
+				for (uint32_t edge = run_first_nodes[runs_number] - 1; edge < edges_.size(); ++edge) {
+					AppendEdgeToNodeDown(edges_[edge].upper_node, edge);
+				}
+			} else {
+				for (uint32_t edge = 0; edge < edges_.size(); ++edge) {
+					AppendEdgeToNodeDown(edges_[edge].upper_node, edge);
+				}
+			}
+
+			// A suffix link is found from the link of the parent, so the
+			// joining nodes go first in the order of depth
+			std::vector<std::pair<uint32_t, uint32_t>> joining_nodes;
+			for (uint32_t node = run_first_nodes[runs_number]; node < nodes_number; ++node) {
+				joining_nodes.push_back(std::make_pair(NodeDepth(node), node));
+			}
+			std::sort(joining_nodes.begin(), joining_nodes.end());
+			for (const std::pair<uint32_t, uint32_t>& joining_node : joining_nodes) {
+				LinkToSuffix(joining_node.second, joining_node.first);
+			}
+			pool->ParallelFor(runs_number, [&](size_t run) {
+				struct SuffixLinker {
+					SuffixTree& tree;
+					uint32_t top_depth;
+
+					void EnterNode(uint32_t node, uint32_t depth) {
+						if (!tree.IsLeaf(node)) {
+							tree.LinkToSuffix(node, top_depth + depth);
+						}
+					}
+
+					void LeaveNode(uint32_t /*node*/, uint32_t /*depth*/) {
+					}
+				};
+				SuffixLinker linker{*this, run_tops[run + 1].depth};
+				TraverseDepthFirst(run_tops[run + 1].node, linker);
+			});
+
+			leaves_number_ = base_string_.size();
+			right_bound_ = base_string_.size() - 1;
+		}
+
+		// Starts of the runs: the smallest common prefix which still gives
+		// enough runs, so that no run is larger than it has to be
+		std::vector<size_t> PartitionSuffixArray(const std::vector<uint32_t>& lcp, size_t runs_wanted) const {
+			std::vector<size_t> runs_by_depth(kMaxPartitionDepth + 2, 0);
+			for (size_t rank = 1; rank < lcp.size(); ++rank) {
+				++runs_by_depth[std::min(lcp[rank], kMaxPartitionDepth) + 1];
+			}
+			uint32_t partition_depth = 1;
+			size_t runs_number = 1 + runs_by_depth[1];
+			while (runs_number < runs_wanted && partition_depth < kMaxPartitionDepth) {
+				++partition_depth;
+				runs_number += runs_by_depth[partition_depth];
+			}
+
+			std::vector<size_t> run_starts;
+			run_starts.reserve(runs_number);
+			run_starts.push_back(0);
+			for (size_t rank = 1; rank < lcp.size(); ++rank) {
+				if (lcp[rank] < partition_depth) {
+					run_starts.push_back(rank);
+				}
+			}
+			return run_starts;
+		}
+
+		// Number of inner nodes LinkSubtrees creates for the same depths
+		template <class DepthAt, class LcpAt>
+		static uint32_t CountInnerNodes(size_t size, DepthAt depth_at, LcpAt lcp_at, 
+				std::vector<uint32_t> * depths) {
+			uint32_t inner_nodes = 0;
+			depths->assign(1, depth_at(0));
+			for (size_t index = 1; index < size; ++index) {
+				uint32_t common_depth = lcp_at(index);
+				while (depths->back() > common_depth) {
+					depths->pop_back();
+					if (depths->empty() || depths->back() < common_depth) {
+						depths->push_back(common_depth);
+						++inner_nodes;
+					}
+				}
+				depths->push_back(depth_at(index));
+			}
+			return inner_nodes;
+		}
+
+		// Joins subtrees which are adjacent in the suffix order into a tree,
+		// lcp_at(i) is the common depth of subtrees i - 1 and i. Creates
+		// inner nodes from next_node on and returns the top of the tree
+		template <class TopAt, class LcpAt>
+		SubtreeTop LinkSubtrees(size_t size, TopAt top_at, LcpAt lcp_at, uint32_t * next_node, 
+				std::vector<SubtreeTop> * stack) {
+			stack->assign(1, top_at(0));
+			for (size_t index = 1; index < size; ++index) {
+				uint32_t common_depth = lcp_at(index);
+				while (stack->back().depth > common_depth) {
+					SubtreeTop child = stack->back();
+					stack->pop_back();
+					if (stack->empty() || stack->back().depth < common_depth) {
+						uint32_t inner_node = (*next_node)++;
+						ResetNode(inner_node, kNoSuffix);
+						stack->push_back(SubtreeTop{inner_node, common_depth, child.suffix});
+					}
+					LinkSubtree(stack->back(), child);
+				}
+				stack->push_back(top_at(index));
+			}
+			while (stack->size() > 1) {
+				SubtreeTop child = stack->back();
+				stack->pop_back();
+				LinkSubtree(stack->back(), child);
+			}
+			return stack->back();
+		}
+
+		// Edges are numbered after their lower nodes. Only the edge is
+		// written, the transitions are filled once all threads finish
+		void LinkSubtree(const SubtreeTop& parent, const SubtreeTop& child) {
+			uint32_t edge = child.node - 1;
+			edges_[edge].upper_node = parent.node;
+			edges_[edge].lower_node = child.node;
+			edges_[edge].left_substring_bound = child.suffix + parent.depth;
+			edges_[edge].right_substring_bound = child.suffix + child.depth;
+			nodes_[child.node].upper_going_edge = edge;
+		}
+
+		void ResetNode(uint32_t node, uint32_t suffix_start) {
+			nodes_[node].upper_going_edge = kNoEdge;
+			nodes_[node].suffix_link = kNoNode;
+			nodes_[node].terminal_edge = kNoEdge;
+			nodes_[node].suffix_start = suffix_start;
+		}
+
+		uint32_t NodeDepth(uint32_t node) const {
+			uint32_t depth = 0;
+			for (; node != kRootNode; node = edges_[nodes_[node].upper_going_edge].upper_node) {
+				depth += EdgeLength(nodes_[node].upper_going_edge);
+			}
+			return depth;
+		}
+
+		// The parent is linked already. Its link spells the path without
+		// the first symbol, so the edge label leads from there to the
+		// link of the node, skipping whole edges by their lengths
+		void LinkToSuffix(uint32_t node, uint32_t depth) {
+			uint32_t upper_edge = nodes_[node].upper_going_edge;
+			uint32_t parent = edges_[upper_edge].upper_node;
+			size_t label_position = edges_[upper_edge].left_substring_bound;
+			uint32_t walking_node = kRootNode;
+			uint32_t walking_depth = 0;
+			if (parent == kRootNode) {
+				++label_position;
+			} else {
+				walking_node = nodes_[parent].suffix_link;
+				walking_depth = depth - EdgeLength(upper_edge) - 1;
+			}
+
+			while (walking_depth + 1 < depth) {
+				uint32_t down_edge = DownEdgeBySymbol(walking_node, base_string_[label_position]);
+				walking_depth += EdgeLength(down_edge);
+				label_position += EdgeLength(down_edge);
+				walking_node = edges_[down_edge].lower_node;
+			}
+			nodes_[node].suffix_link = walking_node;
+		}
+
+		// Start of some suffix which has the path of the node as a prefix
+		uint32_t AnySuffixBelow(uint32_t node) const {
+			while (!IsLeaf(node)) {
+				node = edges_[FirstChildEdge(node)].lower_node;
+			}
+
+			return nodes_[node].suffix_start;
+		}
+
+		uint32_t EdgeLength(uint32_t edge) const {
+			return edges_[edge].right_substring_bound - edges_[edge].left_substring_bound;
+		}
+
+		// Traversals call visitor.EnterNode(node, depth) before the subtree
+		// of a node and visitor.LeaveNode(node, depth) after it. depth is
+		// the string depth counted from the start node, with the terminator
+		// of a leaf included. None of them recurses, so a text like aaaa...
+		// with a path of |S| nodes costs no call stack.
+		//
+		// Children come in FirstChildEdge order. The walk climbs back
+		// through upper edges instead of keeping a stack
+		template <class Visitor>
+		void TraverseDepthFirst(uint32_t start_node, Visitor& visitor) const {
+			uint32_t node = start_node;
+			uint32_t depth = 0;
+			visitor.EnterNode(node, depth);
+			while (true) {
+				uint32_t child_edge = FirstChildEdge(node);
+				if (child_edge != kNoEdge) {
+					node = edges_[child_edge].lower_node;
+					depth += EdgeLength(child_edge);
+					visitor.EnterNode(node, depth);
+					continue;
+				}
+
+				while (true) {
+					visitor.LeaveNode(node, depth);
+					if (node == start_node) {
+						return;
+					}
+					uint32_t upper_edge = nodes_[node].upper_going_edge;
+					depth -= EdgeLength(upper_edge);
+					uint32_t sibling_edge = NextChildEdge(upper_edge);
+					if (sibling_edge != kNoEdge) {
+						node = edges_[sibling_edge].lower_node;
+						depth += EdgeLength(sibling_edge);
+						visitor.EnterNode(node, depth);
+						break;
+					}
+					node = edges_[upper_edge].upper_node;
+				}
+			}
+		}
+
+		// The whole tree with children in lexicographic order, terminators
+		// first. Hash transitions are unordered, so this one keeps an
+		// explicit stack of edges and sorts the children of every node
+		template <class Visitor>
+		void TraverseInOrder(Visitor& visitor) const {
+			std::vector<PendingEdge> pending_edges;
+			visitor.EnterNode(kRootNode, 0);
+			PushChildrenInOrder(kRootNode, 0, &pending_edges);
+			while (!pending_edges.empty()) {
+				PendingEdge pending_edge = pending_edges.back();
+				pending_edges.pop_back();
+				uint32_t node = edges_[pending_edge.edge].lower_node;
+				uint32_t depth = pending_edge.parent_depth + EdgeLength(pending_edge.edge);
+				if (pending_edge.leaving) {
+					visitor.LeaveNode(node, depth);
+					continue;
+				}
+
+				visitor.EnterNode(node, depth);
+				pending_edges.push_back(PendingEdge{pending_edge.edge, pending_edge.parent_depth, true});
+				if (!IsLeaf(node)) {
+					PushChildrenInOrder(node, depth, &pending_edges);
+				}
+			}
+			visitor.LeaveNode(kRootNode, 0);
+		}
+
+		// An edge is pushed once to enter its lower node and once more,
+		// below the children, to leave it
+		struct PendingEdge {
+			uint32_t edge;
+			uint32_t parent_depth;
+			bool leaving;
+		};
+
+		// Pushes children so that they are popped in lexicographic order.
+		// The terminal list runs from the newest document to the oldest
+		void PushChildrenInOrder(uint32_t node, uint32_t depth, 
+				std::vector<PendingEdge> * pending_edges) const {
+			size_t first_pushed = pending_edges->size();
+			for (uint32_t edge = transitions_.FirstEdge(node); edge != kNoEdge; 
+					edge = transitions_.NextEdge(node, base_string_[edges_[edge].left_substring_bound], edge)) {
+				pending_edges->push_back(PendingEdge{edge, depth, false});
+			}
+
+			if (Transitions::kOrderedEdges) {
+				std::reverse(pending_edges->begin() + first_pushed, pending_edges->end());
+			} else {
+				std::sort(pending_edges->begin() + first_pushed, pending_edges->end(), 
+						[this](const PendingEdge& left, const PendingEdge& right) {
+							return base_string_[edges_[right.edge].left_substring_bound] < 
+									base_string_[edges_[left.edge].left_substring_bound];
+						});
+			}
+
+			for (uint32_t edge = FirstTerminalEdge(node); edge != kNoEdge; edge = NextTerminalEdge(edge)) {
+				pending_edges->push_back(PendingEdge{edge, depth, false});
+			}
+		}
 
-    return new_node;
-}
+		bool IsTerminalEdge(uint32_t edge) const {
+			return IsLeaf(edges_[edge].lower_node) && 
+					edges_[edge].right_substring_bound - edges_[edge].left_substring_bound == kOneSymbolLength;
+		}
 
-Edge * GetNewEdge(size_t left_substring_bound, size_t right_substring_bound) {
-    Edge * new_edge = new Edge;
+		// Ukkonen creates at most one leaf and one internal node per symbol.
+		// Capacity grows geometrically so a stream of small documents
+		// does not copy the arenas on every Append
+		void ReserveArenas() {
+			size_t nodes_needed = 2 * base_string_.size() + 1;
+			if (nodes_.capacity() < nodes_needed) {
+				size_t capacity = std::max(nodes_needed, 2 * nodes_.capacity());
+				nodes_.reserve(capacity);
+				edges_.reserve(capacity);
+				transitions_.Reserve(capacity);
+			}
+		}
 
-    new_edge->left_substring_bound = left_substring_bound;
-    new_edge->right_substring_bound = right_substring_bound;
-    new_edge->upper_node_pointer = nullptr;       
-    new_edge->lower_node_pointer = nullptr;    
+		uint32_t GetNewNode() {
+			Node new_node;
+			new_node.upper_going_edge = kNoEdge;
+			new_node.suffix_link = kNoNode;
+			new_node.terminal_edge = kNoEdge;
+			new_node.suffix_start = kNoSuffix;
+			nodes_.push_back(new_node);
+			transitions_.AddNode();
 
-    return new_edge;
-}
+			return nodes_.size() - 1;
+		}
 
-class SuffixTree {
-	public:
-		SuffixTree() {}
+		uint32_t GetNewEdge(size_t left_substring_bound, size_t right_substring_bound) {
+			Edge new_edge;
+			new_edge.left_substring_bound = left_substring_bound;
+			new_edge.right_substring_bound = right_substring_bound;
+			new_edge.upper_node = kNoNode;
+			new_edge.lower_node = kNoNode;
+			edges_.push_back(new_edge);
 
-		bool IfSuffix(const std::string& prefix_candidate) {
-			bool is_prefix = true;
-			bool if_nowhere_to_go = false;
-			Node * walking_node = root_node_;
-			size_t prefix_index = 0;
-			std::string prefix_read;
-			while (!if_nowhere_to_go && is_prefix) {
-				Edge * down_edge = DownEdgeBySymbol(walking_node, prefix_candidate[prefix_index]);
-				if (down_edge != nullptr) {
-					Edge * leading_edge = down_edge;
-					size_t edge_index = leading_edge->left_substring_bound;
-					while (edge_index < leading_edge->right_substring_bound && prefix_index < prefix_candidate.length()) {
-						if (base_string_[edge_index] != prefix_candidate[prefix_index]) {
-							is_prefix = false;
-							break;
-						}
-						prefix_read += base_string_[edge_index];
-						++edge_index;
-						++prefix_index;
-					}
-					walking_node = leading_edge->lower_node_pointer;
-					if (prefix_index == prefix_candidate.length()) {
-						if_nowhere_to_go = true;
-					}
-				} else {
-					if_nowhere_to_go = true;
-				}
-			}
+			return edges_.size() - 1;
+		}
 
-			return prefix_index == prefix_candidate.length();
+		uint32_t FirstTerminalEdge(uint32_t node) const {
+			return IsLeaf(node) ? kNoEdge : nodes_[node].terminal_edge;
 		}
 
-		void Initialize(const std::string& input_string) {
-			root_node_ = GetNewNode();
-			base_string_ = input_string;
-			steps_made_ = 0;
-			sl_created_ = 0;
+		uint32_t NextTerminalEdge(uint32_t terminal_edge) const {
+			return nodes_[edges_[terminal_edge].lower_node].terminal_edge;
+		}
 
-			current_node_ = root_node_;
-			explicit_start_phase_ = true;
-			current_edge_ = nullptr;
-			current_edge_position_ = 0;
+		bool IsLeaf(uint32_t node) const {
+			return nodes_[node].suffix_start != kNoSuffix;
+		}
 
-			for (size_t phase_id = 0; phase_id < base_string_.length(); ++phase_id) {
-				right_bound_ = phase_id;
-				ProcessPhase(phase_id);
+		// Every leaf edge ends with the terminator, which matches nothing
+		size_t MatchableRightBound(uint32_t edge) const {
+			if (IsLeaf(edges_[edge].lower_node)) {
+				return edges_[edge].right_substring_bound - 1;
 			}
-		}
 
-		void PrintTree() {
-			PrintNode(root_node_);
+			return edges_[edge].right_substring_bound;
 		}
 
-	private:
-
-		void PrintNode(Node * node) {
-			if (node == root_node_) {
+		void PrintNode(uint32_t node) const {
+			if (node == kRootNode) {
 				std::cout << "ROOT NODE";
 			} else {
 				std::cout << "NODE";
 			}
 
-			if (node->upper_going_edge != nullptr) {
-				std::cout << ": upper_going_edge = [" << node->upper_going_edge->left_substring_bound << ", " << node->upper_going_edge->right_substring_bound << "), ";
+			if (nodes_[node].upper_going_edge != kNoEdge) {
+				const Edge& upper_edge = edges_[nodes_[node].upper_going_edge];
+				std::cout << ": upper_going_edge = [" << upper_edge.left_substring_bound << ", " << upper_edge.right_substring_bound << "), ";
 			}
 
-			for (size_t symbol_id = 0; symbol_id < kFinalAlphabetSize; ++symbol_id) {
-				if (node->unicode_to_index[symbol_id] != kNoEdge) {
-					size_t index = node->unicode_to_index[symbol_id];
-					std::cout << " " << symbol_id << "_below_edge = [" << node->down_going_edges[index]->left_substring_bound << ", " << node->down_going_edges[index]->right_substring_bound << "), ";
-				}
+			for (uint32_t terminal_edge = FirstTerminalEdge(node); terminal_edge != kNoEdge; 
+					terminal_edge = NextTerminalEdge(terminal_edge)) {
+				std::cout << " $_below_edge = [" << edges_[terminal_edge].left_substring_bound << ", " << edges_[terminal_edge].right_substring_bound << "), ";
 			}
 
+			const FlatArray<Edge>& edges = edges_;
+			transitions_.ForEach(node, [&edges](Symbol symbol, uint32_t edge) {
+				std::cout << " " << symbol << "_below_edge = [" << edges[edge].left_substring_bound << ", " << edges[edge].right_substring_bound << "), ";
+			});
+
 			std::cout << std::endl;
+		}
 
-			for (size_t symbol_id = 0; symbol_id < kFinalAlphabetSize; ++symbol_id) {
-				if (node->unicode_to_index[symbol_id] != kNoEdge) {
-					size_t index = node->unicode_to_index[symbol_id];
-					PrintNode(node->down_going_edges[index]->lower_node_pointer);
-				}
-			}
+		uint32_t DownEdgeBySymbol(uint32_t node, Symbol symbol) const {
+			return transitions_.Find(node, symbol);
 		}
 
-		Edge * DownEdgeBySymbol(Node * node, char symbol) {
-			size_t ascii_code = int(symbol) - int('a');
-			size_t index = node->unicode_to_index[ascii_code];
-			if (index != kNoEdge) {
-				return node->down_going_edges[index];
+		// The terminator is unique, so it is never present in the tree yet
+		bool IfSymbolIsPresent(Symbol appending_symbol, bool is_terminator) const {
+			if (is_terminator) {
+				return false;
 			}
 
-			return nullptr;
-		}
-
-		bool IfSymbolIsPresent(char appending_symbol) {
 			if (explicit_start_phase_) {
-				if (DownEdgeBySymbol(current_node_, appending_symbol) != nullptr) {
+				if (DownEdgeBySymbol(current_node_, appending_symbol) != kNoEdge) {
 					return true;
 				}
 
 				return false;
 			}
 
-			if (base_string_[current_edge_position_ + 1] == appending_symbol) {
+			// Terminators of earlier documents hold Symbol() as a placeholder
+			if (base_string_[current_edge_position_ + 1] == appending_symbol && 
+					(appending_symbol != Symbol() || 
+						current_edge_position_ + 1 < MatchableRightBound(current_edge_))) {
 				return true;
 			}
 
 			return false;
 		}
 
-		void MovePosition(char appending_symbol) {
+		void MovePosition(Symbol appending_symbol) {
 			++steps_made_;
 			if (explicit_start_phase_) {
-				Edge * leading_edge = 
-						DownEdgeBySymbol(current_node_, appending_symbol);
-				if (leading_edge->right_substring_bound - 
-								leading_edge->left_substring_bound == kOneSymbolLength) {
-					current_node_ = leading_edge->lower_node_pointer;
+				uint32_t leading_edge = DownEdgeBySymbol(current_node_, appending_symbol);
+				if (edges_[leading_edge].right_substring_bound - 
+								edges_[leading_edge].left_substring_bound == kOneSymbolLength) {
+					current_node_ = edges_[leading_edge].lower_node;
 				} else {
 					explicit_start_phase_ = false;
 					current_edge_ = leading_edge;
-					current_edge_position_ = leading_edge->left_substring_bound;
+					current_edge_position_ = edges_[leading_edge].left_substring_bound;
 				}
 			} else {
 				++current_edge_position_;
-				if (current_edge_position_ == current_edge_->right_substring_bound - 1) {
+				if (current_edge_position_ == edges_[current_edge_].right_substring_bound - 1) {
 					explicit_start_phase_ = true;
-					current_node_ = current_edge_->lower_node_pointer;
+					current_node_ = edges_[current_edge_].lower_node;
 				}
 			}
 		}
 
-		void AppendEdgeToNodeDown(Node * node, Edge * edge) {
-			char symbol = base_string_[edge->left_substring_bound];
-			size_t ascii_code = int(symbol) - int('a');
-			node->unicode_to_index[ascii_code] = node->down_going_edges.size();
-			node->down_going_edges.push_back(edge);
-			edge->upper_node_pointer = node;
+		// Expects the lower end of the edge to be attached already
+		void AppendEdgeToNodeDown(uint32_t node, uint32_t edge) {
+			const Edge& down_edge = edges_[edge];
+			if (IsTerminalEdge(edge)) {
+				nodes_[down_edge.lower_node].terminal_edge = nodes_[node].terminal_edge;
+				nodes_[node].terminal_edge = edge;
+			} else {
+				transitions_.Insert(node, base_string_[down_edge.left_substring_bound], edge);
+			}
+			edges_[edge].upper_node = node;
+		}
+
+		void AppendEdgeToNodeUp(uint32_t node, uint32_t edge) {
+			edges_[edge].lower_node = node;
+			nodes_[node].upper_going_edge = edge;
 		}
 
-		void AppendEdgeToNodeUp(Node * node, Edge * edge) {
-			edge->lower_node_pointer = node;
-			node->upper_going_edge = edge;
+		uint32_t GetNewLeaf() {
+			uint32_t leaf = GetNewNode();
+			nodes_[leaf].suffix_start = leaves_number_++;
+			return leaf;
 		}
 
-		void AddToTree(char appending_symbol) {
+		void AddToTree() {
 			++steps_made_;
 			if (explicit_start_phase_) {
-				Edge * new_edge = GetNewEdge(right_bound_, base_string_.length());
-				Node * terminal_node = GetNewNode();
-				AppendEdgeToNodeDown(current_node_, new_edge);
+				uint32_t new_edge = GetNewEdge(right_bound_, base_string_.size());
+				uint32_t terminal_node = GetNewLeaf();
 				AppendEdgeToNodeUp(terminal_node, new_edge);
+				AppendEdgeToNodeDown(current_node_, new_edge);
 			} else {
-				Edge * up_edge = GetNewEdge(current_edge_->left_substring_bound, 
-													current_edge_position_ + 1);
-				Edge * down_edge = GetNewEdge(current_edge_position_ + 1, 
-												current_edge_->right_substring_bound);
-				Node * insert_node = GetNewNode();
-				Node * previous_node = current_edge_->upper_node_pointer;
-				Node * next_node = current_edge_->lower_node_pointer;
-				Edge * short_edge = GetNewEdge(right_bound_, base_string_.length());
-				Node * terminal_node = GetNewNode();
-
-				AppendEdgeToNodeDown(previous_node, up_edge);
+				// The split edge keeps its slot in the parent transitions and
+				// becomes the upper half, so no edge is ever abandoned
+				uint32_t up_edge = current_edge_;
+				uint32_t down_edge = GetNewEdge(current_edge_position_ + 1, 
+												edges_[up_edge].right_substring_bound);
+				uint32_t insert_node = GetNewNode();
+				uint32_t next_node = edges_[up_edge].lower_node;
+				uint32_t short_edge = GetNewEdge(right_bound_, base_string_.size());
+				uint32_t terminal_node = GetNewLeaf();
+
+				edges_[up_edge].right_substring_bound = current_edge_position_ + 1;
 				AppendEdgeToNodeUp(insert_node, up_edge);
 
-				AppendEdgeToNodeDown(insert_node, short_edge);
+				// Older leaf first, so terminal lists stay newest first
+				AppendEdgeToNodeUp(next_node, down_edge);
+				AppendEdgeToNodeDown(insert_node, down_edge);
+
 				AppendEdgeToNodeUp(terminal_node, short_edge);
+				AppendEdgeToNodeDown(insert_node, short_edge);
 
-				AppendEdgeToNodeDown(insert_node, down_edge);
-				AppendEdgeToNodeUp(next_node, down_edge);
+				// The node split in the previous extension spells this one
+				// with its first symbol in front
+				if (unlinked_node_ != kNoNode) {
+					nodes_[unlinked_node_].suffix_link = insert_node;
+					unlinked_node_ = kNoNode;
+				}
 
 				explicit_start_phase_ = true;
 				current_node_ = insert_node;
@@ -226,30 +2416,37 @@ class SuffixTree {
 		}
 
 		bool NewPositionAndSuffixLink() {
-			if (current_node_ == root_node_) {
+			if (current_node_ == kRootNode) {
 				return false;
 			}
 
-			Node * walking_node = current_node_;
+			// Every inner node except the newest one has its link already
+			if (nodes_[current_node_].suffix_link != kNoNode) {
+				++sl_created_;
+				current_node_ = nodes_[current_node_].suffix_link;
+				return true;
+			}
+
+			uint32_t walking_node = current_node_;
 			bool if_achieved_root = false;
 			bool if_found_suffix_link = false;
 
 			size_t gamma_string_right_bound = 
-				current_node_->upper_going_edge->right_substring_bound;
+				edges_[nodes_[current_node_].upper_going_edge].right_substring_bound;
 			size_t gamma_string_left_bound = gamma_string_right_bound;
 
 			while (!if_achieved_root && !if_found_suffix_link) {
 				++steps_made_;
+				const Edge& upper_edge = edges_[nodes_[walking_node].upper_going_edge];
 				gamma_string_left_bound -= 
-					(walking_node->upper_going_edge->right_substring_bound - 
-						walking_node->upper_going_edge->left_substring_bound);
-				walking_node = walking_node->upper_going_edge->upper_node_pointer;
+					(upper_edge.right_substring_bound - upper_edge.left_substring_bound);
+				walking_node = upper_edge.upper_node;
 				
-				if (walking_node == root_node_) {
+				if (walking_node == kRootNode) {
 					if_achieved_root = true;
 				}
 
-				if (walking_node->suffix_link_pointer != nullptr) {
+				if (nodes_[walking_node].suffix_link != kNoNode) {
 					if_found_suffix_link = true;
 				}
 			}
@@ -259,49 +2456,52 @@ class SuffixTree {
 			}
 
 			if (if_found_suffix_link) {
-				walking_node = walking_node->suffix_link_pointer;
+				walking_node = nodes_[walking_node].suffix_link;
 				++sl_created_;
 			}
 
 			while (gamma_string_right_bound > gamma_string_left_bound) {
 				++steps_made_;
-				char next_char = base_string_[gamma_string_left_bound];
-				Edge * leading_edge = DownEdgeBySymbol(walking_node, next_char);
-				if (leading_edge->right_substring_bound - leading_edge->left_substring_bound
+				Symbol next_char = base_string_[gamma_string_left_bound];
+				const Edge& leading_edge = edges_[DownEdgeBySymbol(walking_node, next_char)];
+				if (leading_edge.right_substring_bound - leading_edge.left_substring_bound
 				 <= gamma_string_right_bound - gamma_string_left_bound) {
 					gamma_string_left_bound += 
-						leading_edge->right_substring_bound - leading_edge->left_substring_bound;
-					walking_node = leading_edge->lower_node_pointer;
+						leading_edge.right_substring_bound - leading_edge.left_substring_bound;
+					walking_node = leading_edge.lower_node;
 				} else {
 					break;
 				}
 			}
 			
 			if (gamma_string_left_bound < gamma_string_right_bound) {
-				char next_char = base_string_[gamma_string_left_bound];
-				Edge * leading_edge = DownEdgeBySymbol(walking_node, next_char);
+				Symbol next_char = base_string_[gamma_string_left_bound];
+				uint32_t leading_edge = DownEdgeBySymbol(walking_node, next_char);
 				explicit_start_phase_ = false;
 				current_edge_ = leading_edge;
 				current_edge_position_ = gamma_string_right_bound - 
-								gamma_string_left_bound - 1 + current_edge_->left_substring_bound;
+								gamma_string_left_bound - 1 + edges_[current_edge_].left_substring_bound;
+				// The link target does not exist yet: the next extension
+				// splits this edge right here
+				unlinked_node_ = current_node_;
 			} else {
-				current_node_->suffix_link_pointer = walking_node;
+				nodes_[current_node_].suffix_link = walking_node;
 				current_node_ = walking_node;
 			}
 			return true;
 		}
 
-		void ProcessPhase(size_t phase_id) {
-			char appending_symbol = base_string_[phase_id];
+		void ProcessPhase(size_t phase_id, bool is_terminator) {
+			Symbol appending_symbol = base_string_[phase_id];
 			bool third_transition_happened = false;
 			bool nowhere_to_go = false;
 
 			while (!nowhere_to_go && !third_transition_happened) {
-				if (IfSymbolIsPresent(appending_symbol)) {
+				if (IfSymbolIsPresent(appending_symbol, is_terminator)) {
 					MovePosition(appending_symbol);
 					third_transition_happened = true;
 				} else {
-					AddToTree(appending_symbol);
+					AddToTree();
 				}
 				if (!third_transition_happened) {
 					nowhere_to_go = !NewPositionAndSuffixLink();
@@ -310,50 +2510,830 @@ class SuffixTree {
 		}
 		size_t steps_made_;
 		size_t sl_created_;
-		Node * current_node_;
+		uint32_t current_node_;
 		bool explicit_start_phase_;
-		Edge * current_edge_;
+		uint32_t current_edge_;
 		size_t current_edge_position_;
+		// Inner node split in the last extension whose link is pending
+		uint32_t unlinked_node_;
 		
-		Node * root_node_;
-		std::string base_string_;
+		FlatArray<Node> nodes_;
+		FlatArray<Edge> edges_;
+		Transitions transitions_;
+		// Documents concatenated together with their terminators
+		FlatArray<Symbol> base_string_;
+		FlatArray<uint64_t> document_starts_;
+		mutable FlatArray<uint32_t> leaf_counts_;
+		// Keeps the arrays of a loaded tree alive
+		std::shared_ptr<const MappedFile> mapped_file_;
 		size_t right_bound_;
+		uint32_t leaves_number_;
+};
+
+template <class Symbol, class Transitions>
+const uint32_t SuffixTree<Symbol, Transitions>::kRootNode;
+template <class Symbol, class Transitions>
+const uint32_t SuffixTree<Symbol, Transitions>::kMaxPartitionDepth;
+
+typedef SuffixTree<char, DenseTransitions<char>> LowercaseSuffixTree;
+typedef SuffixTree<unsigned char, SortedTransitions<unsigned char>> ByteSuffixTree;
+typedef SuffixTree<uint32_t, HashTransitions<uint32_t>> TokenSuffixTree;
+
+// Suffix array with LCP array over a single text, built directly by
+// SA-IS and queried by binary search. It answers IfSuffix, Count and
+// Locate like SuffixTree with 9 bytes per byte symbol instead of tens.
+// The empty suffix at the end of the text comes first, as the terminator
+// leaf does in SuffixTree::ToSuffixArray
+template <class Symbol = char>
+class SuffixArray {
+	public:
+		template <class Sequence>
+		void Initialize(const Sequence& input_string) {
+			Initialize(std::begin(input_string), std::end(input_string));
+		}
+
+		template <class Iterator>
+		void Initialize(Iterator begin, Iterator end) {
+			text_.clear();
+			text_.append(begin, end);
+			if (text_.size() + 1 > kMaxStringLength) {
+				text_.clear();
+				throw std::length_error("string is too long for 32-bit suffix array indices");
+			}
+			mapped_file_.reset();
+
+			std::vector<uint32_t> codes;
+			uint32_t upper_code = EncodeText(&codes);
+			std::vector<uint32_t> suffix_array = InducedSortSuffixes(codes, upper_code);
+			suffix_array_.clear();
+			suffix_array_.append(suffix_array.begin(), suffix_array.end());
+			ComputeLcp(codes, suffix_array, &lcp_);
+		}
+
+		template <class Sequence>
+		bool IfSuffix(const Sequence& prefix_candidate) const {
+			return Count(prefix_candidate) > 0;
+		}
+
+		// O(|pattern| log |text|)
+		template <class Sequence>
+		size_t Count(const Sequence& pattern) const {
+			size_t first, last;
+			EqualRange(pattern, &first, &last);
+			return last - first;
+		}
+
+		// Calls on_match(position) for the start of every occurrence in
+		// lexicographic order of the suffixes
+		template <class Sequence, class Callback>
+		void Locate(const Sequence& pattern, Callback on_match) const {
+			size_t first, last;
+			EqualRange(pattern, &first, &last);
+			for (size_t rank = first; rank < last; ++rank) {
+				on_match(size_t(suffix_array_[rank]));
+			}
+		}
+
+		const FlatArray<uint32_t>& Suffixes() const {
+			return suffix_array_;
+		}
+
+		// lcp[i] is the common prefix length of suffixes i - 1 and i
+		const FlatArray<uint32_t>& Lcp() const {
+			return lcp_;
+		}
+
+		void Save(const std::string& path) const {
+			FileWriteArchive archive(path);
+			const_cast<SuffixArray *>(this)->Serialize(archive);
+			archive.Finish();
+		}
+
+		// A rejected or truncated file leaves the array as it was
+		void Load(const std::string& path) {
+			SuffixArray loaded;
+			MappedReadArchive archive(path);
+			loaded.Serialize(archive);
+			loaded.mapped_file_ = archive.File();
+			*this = std::move(loaded);
+		}
+
+	private:
+		static const uint64_t kArchiveMagic = 0x5355464641525259;
+
+		template <class Archive>
+		void Serialize(Archive& archive) {
+			CheckArchiveTag(archive, kArchiveMagic);
+			CheckArchiveTag(archive, sizeof(Symbol));
+			archive.Array(text_);
+			archive.Array(suffix_array_);
+			archive.Array(lcp_);
+		}
+
+		// Codes keep the order of symbols, 0 is the terminator
+		uint32_t EncodeText(std::vector<uint32_t> * codes) const {
+			static_assert(sizeof(Symbol) <= sizeof(uint32_t), "symbols must fit into 32-bit codes");
+			codes->reserve(text_.size() + 1);
+			if (sizeof(Symbol) <= 2) {
+				for (Symbol symbol : text_) {
+					codes->push_back(int64_t(symbol) - int64_t(std::numeric_limits<Symbol>::min()) + 1);
+				}
+				codes->push_back(0);
+				return uint32_t(std::numeric_limits<Symbol>::max()) - 
+						uint32_t(std::numeric_limits<Symbol>::min()) + 1;
+			}
+
+			std::vector<Symbol> alphabet(text_.begin(), text_.end());
+			std::sort(alphabet.begin(), alphabet.end());
+			alphabet.erase(std::unique(alphabet.begin(), alphabet.end()), alphabet.end());
+			for (Symbol symbol : text_) {
+				codes->push_back(std::lower_bound(alphabet.begin(), alphabet.end(), symbol) - 
+						alphabet.begin() + 1);
+			}
+			codes->push_back(0);
+			return alphabet.size();
+		}
+
+		// Ranks of the suffixes starting with the pattern
+		template <class Sequence>
+		void EqualRange(const Sequence& pattern, size_t * first, size_t * last) const {
+			*first = std::partition_point(suffix_array_.begin(), suffix_array_.end(), 
+					[this, &pattern](uint32_t suffix) { return ComparePrefix(suffix, pattern) < 0; }) - 
+					suffix_array_.begin();
+			*last = std::partition_point(suffix_array_.begin() + *first, suffix_array_.end(), 
+					[this, &pattern](uint32_t suffix) { return ComparePrefix(suffix, pattern) == 0; }) - 
+					suffix_array_.begin();
+		}
+
+		// Compares the first |pattern| symbols of the suffix with the pattern
+		template <class Sequence>
+		int ComparePrefix(size_t suffix, const Sequence& pattern) const {
+			for (size_t index = 0; index < pattern.size(); ++index) {
+				if (suffix + index == text_.size()) {
+					return -1;
+				}
+				Symbol symbol = Symbol(pattern[index]);
+				if (text_[suffix + index] != symbol) {
+					return text_[suffix + index] < symbol ? -1 : 1;
+				}
+			}
+
+			return 0;
+		}
+
+		FlatArray<Symbol> text_;
+		FlatArray<uint32_t> suffix_array_;
+		FlatArray<uint32_t> lcp_;
+		std::shared_ptr<const MappedFile> mapped_file_;
+};
+
+// Suffix array of a byte text larger than memory. Build sorts the
+// suffixes group by group straight from the mapped text file, each group
+// being the suffixes whose first symbols fall into a range that fits the
+// memory budget, and streams the groups into an index file with a copy
+// of the text. Load maps the index, so queries page in only the parts
+// they touch. Positions are 64-bit and there is no LCP array
+class ExternalSuffixArray {
+	public:
+		static const size_t kDefaultMemoryBudget = size_t(1) << 30;
+
+		// Texts which fit into the budget are sorted in memory by induced
+		// sorting. Larger ones are sorted by prefix doubling: every round
+		// pairs the names of prefixes with the names of the prefixes right
+		// after them and renames the pairs, which takes two sorts of tuples
+		// spilled to disk. The number of rounds is logarithmic in the
+		// longest repeat and every round streams O(|text|) tuples, whatever
+		// the budget
+		static void Build(const std::string& text_path, const std::string& index_path, 
+				size_t memory_budget = kDefaultMemoryBudget) {
+			MappedFile text(text_path);
+			FileWriteArchive archive(index_path);
+			CheckArchiveTag(archive, kArchiveMagic);
+			CheckArchiveTag(archive, sizeof(char));
+
+			archive.ArrayHeader<char>(text.Size());
+			for (size_t offset = 0; offset < text.Size(); offset += kCopyBlock) {
+				archive.ArrayPart(text.Data() + offset, std::min(kCopyBlock, text.Size() - offset));
+			}
+
+			archive.ArrayHeader<uint64_t>(text.Size());
+			if (text.Size() <= memory_budget / kInMemoryBytesPerSymbol && 
+					text.Size() < std::numeric_limits<uint32_t>::max()) {
+				SortInMemory(text.Data(), text.Size(), &archive);
+			} else {
+				SortByDoubling(text.Data(), text.Size(), index_path, memory_budget, &archive);
+			}
+			archive.Finish();
+		}
+
+		// The arrays are read aside, so a rejected or truncated file
+		// leaves the index as it was
+		void Load(const std::string& path) {
+			MappedReadArchive archive(path);
+			CheckArchiveTag(archive, kArchiveMagic);
+			CheckArchiveTag(archive, sizeof(char));
+			FlatArray<char> text;
+			FlatArray<uint64_t> suffix_array;
+			archive.Array(text);
+			archive.Array(suffix_array);
+			text_.swap(text);
+			suffix_array_.swap(suffix_array);
+			mapped_file_ = archive.File();
+		}
+
+		template <class Sequence>
+		bool IfSuffix(const Sequence& prefix_candidate) const {
+			return Count(prefix_candidate) > 0;
+		}
+
+		// O(|pattern| log |text|)
+		template <class Sequence>
+		size_t Count(const Sequence& pattern) const {
+			uint64_t first, last;
+			EqualRange(pattern, &first, &last);
+			return last - first;
+		}
+
+		// Calls on_match(position) for the start of every occurrence in
+		// lexicographic order of the suffixes
+		template <class Sequence, class Callback>
+		void Locate(const Sequence& pattern, Callback on_match) const {
+			uint64_t first, last;
+			EqualRange(pattern, &first, &last);
+			for (uint64_t rank = first; rank < last; ++rank) {
+				on_match(suffix_array_[rank]);
+			}
+		}
+
+		const FlatArray<uint64_t>& Suffixes() const {
+			return suffix_array_;
+		}
+
+	private:
+		static const uint64_t kArchiveMagic = 0x4558544552534158;
+
+		static const size_t kCopyBlock = size_t(1) << 20;
+		// Peak of induced sorting: codes, the suffix array and the recursion
+		static const size_t kInMemoryBytesPerSymbol = 24;
+		// The first names pack this many symbols of 9 bits, symbol + 1 or 0
+		// past the end of the text, so the order of names is the order of
+		// prefixes
+		static const size_t kPackedSymbols = 7;
+
+		// (name, name of the prefix step symbols further, position) while
+		// renaming and (position mod step, position / step, name) while
+		// pairing, compared lexicographically
+		struct Tuple {
+			uint64_t first;
+			uint64_t second;
+			uint64_t third;
+
+			bool operator<(const Tuple& other) const {
+				if (first != other.first) {
+					return first < other.first;
+				}
+				return second != other.second ? second < other.second : third < other.third;
+			}
+		};
+
+		// Removes the file when going out of scope, also on exceptions
+		class TemporaryFile {
+			public:
+				explicit TemporaryFile(const std::string& path) : path_(path) {}
+
+				TemporaryFile(const TemporaryFile&) = delete;
+				TemporaryFile& operator=(const TemporaryFile&) = delete;
+
+				~TemporaryFile() {
+					unlink(path_.c_str());
+				}
+
+				const std::string& Path() const {
+					return path_;
+				}
+
+			private:
+				std::string path_;
+		};
+
+		// Sorts more tuples than fit into memory: full buffers are sorted and
+		// spilled to run files, which are merged with a block of every run in
+		// memory. Can be refilled once merged
+		class TupleSorter {
+			public:
+				TupleSorter(const std::string& path_prefix, size_t tuples_limit) 
+						: path_prefix_(path_prefix), tuples_limit_(std::max<size_t>(tuples_limit, 1)), 
+						  runs_made_(0) {}
+
+				void Push(const Tuple& tuple) {
+					if (buffer_.size() == tuples_limit_) {
+						Spill();
+					}
+					buffer_.push_back(tuple);
+				}
+
+				// Calls visit(tuple) for all pushed tuples in sorted order
+				template <class Visitor>
+				void Merge(Visitor visit) {
+					if (runs_.empty()) {
+						std::sort(buffer_.begin(), buffer_.end());
+						for (const Tuple& tuple : buffer_) {
+							visit(tuple);
+						}
+						buffer_.clear();
+						return;
+					}
+
+					if (!buffer_.empty()) {
+						Spill();
+					}
+					std::vector<Tuple>().swap(buffer_);
+					// Runs beyond the fan-in are merged into longer runs first,
+					// so merge blocks do not get too small for sequential reads
+					size_t fan_in = std::max<size_t>(tuples_limit_ / kMinMergeBlock, 2);
+					while (runs_.size() > fan_in) {
+						runs_.emplace_back(NextRunPath());
+						std::ofstream output(runs_.back().Path().c_str(), std::ios::binary | std::ios::trunc);
+						MergeRuns(fan_in, [&output](const Tuple& tuple) {
+							output.write(reinterpret_cast<const char *>(&tuple), sizeof(tuple));
+						});
+						CheckWritten(output, runs_.back().Path());
+					}
+					MergeRuns(runs_.size(), visit);
+				}
+
+			private:
+				static const size_t kMinMergeBlock = size_t(1) << 10;
+
+				class RunReader {
+					public:
+						RunReader(const std::string& path, size_t block_size) 
+								: input_(path.c_str(), std::ios::binary), block_(block_size), 
+								  size_(0), index_(0) {}
+
+						bool Next(Tuple * tuple) {
+							if (index_ == size_) {
+								input_.read(reinterpret_cast<char *>(block_.data()), block_.size() * sizeof(Tuple));
+								size_ = input_.gcount() / sizeof(Tuple);
+								index_ = 0;
+								if (size_ == 0) {
+									return false;
+								}
+							}
+							*tuple = block_[index_++];
+							return true;
+						}
+
+					private:
+						std::ifstream input_;
+						std::vector<Tuple> block_;
+						size_t size_;
+						size_t index_;
+				};
+
+				void Spill() {
+					std::sort(buffer_.begin(), buffer_.end());
+					runs_.emplace_back(NextRunPath());
+					std::ofstream output(runs_.back().Path().c_str(), std::ios::binary | std::ios::trunc);
+					output.write(reinterpret_cast<const char *>(buffer_.data()), buffer_.size() * sizeof(Tuple));
+					CheckWritten(output, runs_.back().Path());
+					buffer_.clear();
+				}
+
+				// Merges the oldest runs_number runs and removes them
+				template <class Visitor>
+				void MergeRuns(size_t runs_number, Visitor visit) {
+					size_t block_size = std::max<size_t>(tuples_limit_ / runs_number, 1);
+					std::deque<RunReader> readers;
+					typedef std::pair<Tuple, size_t> Head;
+					std::vector<Head> heads;
+					for (size_t run = 0; run < runs_number; ++run) {
+						readers.emplace_back(runs_[run].Path(), block_size);
+						Tuple tuple;
+						if (readers.back().Next(&tuple)) {
+							heads.emplace_back(tuple, run);
+						}
+					}
+
+					auto later = [](const Head& left, const Head& right) { return right.first < left.first; };
+					std::make_heap(heads.begin(), heads.end(), later);
+					while (!heads.empty()) {
+						std::pop_heap(heads.begin(), heads.end(), later);
+						visit(heads.back().first);
+						if (readers[heads.back().second].Next(&heads.back().first)) {
+							std::push_heap(heads.begin(), heads.end(), later);
+						} else {
+							heads.pop_back();
+						}
+					}
+					readers.clear();
+					for (size_t run = 0; run < runs_number; ++run) {
+						runs_.pop_front();
+					}
+				}
+
+				std::string NextRunPath() {
+					return path_prefix_ + "." + std::to_string(runs_made_++);
+				}
+
+				static void CheckWritten(std::ofstream& output, const std::string& path) {
+					output.flush();
+					if (!output) {
+						throw std::runtime_error("failed to write " + path);
+					}
+				}
+
+				std::string path_prefix_;
+				size_t tuples_limit_;
+				std::vector<Tuple> buffer_;
+				std::deque<TemporaryFile> runs_;
+				size_t runs_made_;
+		};
+
+		static void SortInMemory(const char * text, uint64_t length, FileWriteArchive * archive) {
+			std::vector<uint32_t> codes(length);
+			for (uint64_t position = 0; position < length; ++position) {
+				codes[position] = static_cast<unsigned char>(text[position]);
+			}
+			std::vector<uint32_t> suffix_array = 
+					InducedSortSuffixes(codes, std::numeric_limits<unsigned char>::max());
+			std::vector<uint32_t>().swap(codes);
+
+			std::vector<uint64_t> block;
+			for (size_t offset = 0; offset < suffix_array.size(); offset += kCopyBlock) {
+				size_t end = std::min(offset + kCopyBlock, suffix_array.size());
+				block.assign(suffix_array.begin() + offset, suffix_array.begin() + end);
+				archive->ArrayPart(block.data(), block.size());
+			}
+		}
+
+		static void SortByDoubling(const char * text, uint64_t length, const std::string& index_path, 
+				size_t memory_budget, FileWriteArchive * archive) {
+			// One sorter is merged while the other one is filled
+			size_t tuples_limit = memory_budget / 2 / sizeof(Tuple);
+			TupleSorter prefixes(index_path + ".prefixes", tuples_limit);
+			TupleSorter positions(index_path + ".positions", tuples_limit);
+			for (uint64_t position = 0; position < length; ++position) {
+				prefixes.Push(Tuple{PackedSymbols(text, length, position), 
+						PackedSymbols(text, length, position + kPackedSymbols), position});
+			}
+
+			TemporaryFile order(index_path + ".order");
+			for (uint64_t step = 2 * kPackedSymbols; ; step *= 2) {
+				// Names are ranks + 1 of the first prefix equal to the given one,
+				// the positions are kept in this order in case all names differ
+				std::ofstream order_output(order.Path().c_str(), std::ios::binary | std::ios::trunc);
+				uint64_t rank = 0;
+				uint64_t name = 0;
+				Tuple previous = Tuple();
+				bool all_different = true;
+				prefixes.Merge([&](const Tuple& tuple) {
+					if (rank == 0 || tuple.first != previous.first || tuple.second != previous.second) {
+						name = rank + 1;
+					} else {
+						all_different = false;
+					}
+					previous = tuple;
+					++rank;
+					positions.Push(Tuple{tuple.third % step, tuple.third / step, name});
+					order_output.write(reinterpret_cast<const char *>(&tuple.third), sizeof(tuple.third));
+				});
+				order_output.close();
+				if (!order_output) {
+					throw std::runtime_error("failed to write " + order.Path());
+				}
+				if (all_different) {
+					CopySuffixes(order.Path(), length, archive);
+					return;
+				}
+
+				// Positions step apart are neighbours in this order, the last
+				// position of every residue is paired with the end of the text
+				bool has_previous = false;
+				positions.Merge([&](const Tuple& tuple) {
+					if (has_previous) {
+						uint64_t next_name = previous.first == tuple.first ? tuple.third : 0;
+						prefixes.Push(Tuple{previous.third, next_name, previous.first + previous.second * step});
+					}
+					previous = tuple;
+					has_previous = true;
+				});
+				prefixes.Push(Tuple{previous.third, 0, previous.first + previous.second * step});
+			}
+		}
+
+		static uint64_t PackedSymbols(const char * text, uint64_t length, uint64_t position) {
+			uint64_t packed = 0;
+			for (uint64_t index = position; index < position + kPackedSymbols; ++index) {
+				packed <<= 9;
+				if (index < length) {
+					packed |= static_cast<unsigned char>(text[index]) + 1;
+				}
+			}
+			return packed;
+		}
+
+		static void CopySuffixes(const std::string& path, uint64_t length, FileWriteArchive * archive) {
+			std::ifstream input(path.c_str(), std::ios::binary);
+			std::vector<uint64_t> block(kCopyBlock / sizeof(uint64_t));
+			uint64_t copied = 0;
+			while (input.read(reinterpret_cast<char *>(block.data()), block.size() * sizeof(uint64_t)) || 
+					input.gcount() > 0) {
+				size_t size = input.gcount() / sizeof(uint64_t);
+				archive->ArrayPart(block.data(), size);
+				copied += size;
+			}
+			if (copied != length) {
+				throw std::logic_error("external suffix array lost suffixes");
+			}
+		}
+
+		template <class Sequence>
+		void EqualRange(const Sequence& pattern, uint64_t * first, uint64_t * last) const {
+			*first = std::partition_point(suffix_array_.begin(), suffix_array_.end(), 
+					[this, &pattern](uint64_t suffix) { return ComparePrefix(suffix, pattern) < 0; }) - 
+					suffix_array_.begin();
+			*last = std::partition_point(suffix_array_.begin() + *first, suffix_array_.end(), 
+					[this, &pattern](uint64_t suffix) { return ComparePrefix(suffix, pattern) == 0; }) - 
+					suffix_array_.begin();
+		}
+
+		// Symbols compare as unsigned bytes, as they do during Build
+		template <class Sequence>
+		int ComparePrefix(uint64_t suffix, const Sequence& pattern) const {
+			for (size_t index = 0; index < pattern.size(); ++index) {
+				if (suffix + index == text_.size()) {
+					return -1;
+				}
+				unsigned char symbol = static_cast<unsigned char>(pattern[index]);
+				unsigned char text_symbol = static_cast<unsigned char>(text_[suffix + index]);
+				if (text_symbol != symbol) {
+					return text_symbol < symbol ? -1 : 1;
+				}
+			}
+
+			return 0;
+		}
+
+		FlatArray<char> text_;
+		FlatArray<uint64_t> suffix_array_;
+		std::shared_ptr<const MappedFile> mapped_file_;
+};
+
+const size_t ExternalSuffixArray::kCopyBlock;
+
+// Answers batches of patterns against a tree which is not modified while
+// a batch runs. Results are returned in the order of the patterns
+template <class Tree>
+class BatchQueryEngine {
+	public:
+		explicit BatchQueryEngine(const Tree& tree, 
+				size_t threads_number = std::thread::hardware_concurrency()) 
+				: tree_(tree), pool_(threads_number) {}
+
+		template <class Sequence>
+		std::vector<size_t> Count(const std::vector<Sequence>& patterns) {
+			tree_.UpdateLeafCounts();
+			std::vector<size_t> counts(patterns.size());
+			const Tree& tree = tree_;
+			pool_.ParallelFor(patterns.size(), [&tree, &patterns, &counts](size_t index) {
+				counts[index] = tree.Count(patterns[index]);
+			});
+			return counts;
+		}
+
+		// std::vector<bool> packs bits and cannot be written concurrently
+		template <class Sequence>
+		std::vector<char> IfSuffix(const std::vector<Sequence>& patterns) {
+			std::vector<char> answers(patterns.size());
+			const Tree& tree = tree_;
+			pool_.ParallelFor(patterns.size(), [&tree, &patterns, &answers](size_t index) {
+				answers[index] = tree.IfSuffix(patterns[index]);
+			});
+			return answers;
+		}
+
+	private:
+		const Tree& tree_;
+		ThreadPool pool_;
 };
 
-int main() {
-	/*
-	std::string test_string;
-	std::cin >> test_string;
-	SuffixTree suffix_tree;
-	suffix_tree.Initialize(test_string);
-	suffix_tree.PrintTree();
-	*/
-	
+// Construction benchmark. Arguments are --key=value pairs, lists are
+// comma separated:
+//   --lengths=100000            text lengths
+//   --alphabets=26              alphabet sizes, up to 256; fibonacci
+//                               texts always have 2 letters
+//   --distributions=random      random, periodic, fibonacci or text
+//   --text=path                 source of the text distribution
+//   --transitions=dense         dense, sorted or hash
+//   --threads=0                 0 runs Ukkonen's algorithm, more runs
+//                               InitializeInParallel on that many threads
+//   --repeats=10                runs per configuration
+//   --format=csv                csv or json
+//   --print                     prints the tree of a string from stdin
+typedef std::map<std::string, std::string> BenchmarkOptions;
+
+BenchmarkOptions ParseOptions(int argc, char * argv[]) {
+	BenchmarkOptions options;
+	options["lengths"] = "100000";
+	options["alphabets"] = "26";
+	options["distributions"] = "random";
+	options["transitions"] = "dense";
+	options["threads"] = "0";
+	options["repeats"] = "10";
+	options["format"] = "csv";
+
+	for (int argument_id = 1; argument_id < argc; ++argument_id) {
+		std::string argument = argv[argument_id];
+		if (argument.compare(0, 2, "--") != 0) {
+			throw std::invalid_argument("unexpected argument " + argument);
+		}
+		size_t equality = argument.find('=');
+		if (equality == std::string::npos) {
+			options[argument.substr(2)] = "1";
+		} else {
+			options[argument.substr(2, equality - 2)] = argument.substr(equality + 1);
+		}
+	}
+
+	return options;
+}
+
+std::vector<std::string> SplitList(const std::string& list) {
+	std::vector<std::string> items;
+	std::stringstream stream(list);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		items.push_back(item);
+	}
+	return items;
+}
+
+std::string GenerateText(const std::string& distribution, size_t length, size_t alphabet_size, 
+		const BenchmarkOptions& options, std::mt19937 * generator) {
+	if (alphabet_size == 0 || alphabet_size > 256) {
+		throw std::invalid_argument("alphabet size must be in [1, 256]");
+	}
+	// Letters keep small alphabets compatible with LowercaseSuffixTree
+	int first_symbol = alphabet_size <= kFinalAlphabetSize ? 'a' : 0;
+	std::uniform_int_distribution<int> symbol_distribution(0, alphabet_size - 1);
+	std::string text;
+	text.reserve(length);
+
+	if (distribution == "random") {
+		while (text.size() < length) {
+			text += char(first_symbol + symbol_distribution(*generator));
+		}
+	} else if (distribution == "periodic") {
+		const size_t kPeriod = 17;
+		std::string period;
+		while (period.size() < kPeriod) {
+			period += char(first_symbol + symbol_distribution(*generator));
+		}
+		while (text.size() < length) {
+			text += period[text.size() % kPeriod];
+		}
+	} else if (distribution == "fibonacci") {
+		std::string previous = "b";
+		text = "a";
+		while (text.size() < length) {
+			std::string next = text + previous;
+			previous.swap(text);
+			text.swap(next);
+		}
+		text.resize(length);
+	} else if (distribution == "text") {
+		if (options.count("text") == 0) {
+			throw std::invalid_argument("text distribution needs --text=path");
+		}
+		std::ifstream input(options.at("text").c_str(), std::ios::binary);
+		std::string source((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+		if (source.empty()) {
+			throw std::runtime_error("can not read " + options.at("text"));
+		}
+		while (text.size() < length) {
+			text.append(source, 0, length - text.size());
+		}
+	} else {
+		throw std::invalid_argument("unknown distribution " + distribution);
+	}
+
+	return text;
+}
+
+// Peak resident set of the whole process so far, in kilobytes
+size_t PeakRssKilobytes() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+template <class Tree>
+ConstructionStatistics MeasureConstruction(const std::string& text, ThreadPool * pool, double * seconds) {
+	auto start = std::chrono::steady_clock::now();
+	Tree suffix_tree;
+	if (pool == nullptr) {
+		suffix_tree.Initialize(text);
+	} else {
+		suffix_tree.InitializeInParallel(std::vector<std::string>(1, text), pool);
+	}
+	*seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return suffix_tree.Statistics();
+}
+
+int RunBenchmark(const BenchmarkOptions& options) {
 	std::random_device random_device;
-    std::mt19937 generate(random_device());
-    std::uniform_int_distribution<> distribution(0, 25);
+	std::mt19937 generator(random_device());
+	const std::string& transitions = options.at("transitions");
+	bool json = options.at("format") == "json";
+	size_t repeats = std::stoul(options.at("repeats"));
+	size_t threads_number = std::stoul(options.at("threads"));
+	std::unique_ptr<ThreadPool> pool;
+	if (threads_number > 0) {
+		pool.reset(new ThreadPool(threads_number));
+	}
+
+	if (json) {
+		std::cout << "[" << std::endl;
+	} else {
+		std::cout << "distribution,transitions,threads,length,alphabet,run,seconds,ns_per_char,"
+				"peak_rss_kb,nodes,edges,leaves,steps_made,suffix_links_used" << std::endl;
+	}
 
-	for (size_t attempt = 0; attempt < 10; ++attempt) {
+	bool first_record = true;
+	for (const std::string& distribution : SplitList(options.at("distributions"))) {
+		// The alphabet axis collapses to the one real size of Fibonacci words,
+		// so their rows are not labeled with sizes they were never built with
+		std::vector<std::string> alphabets = distribution == "fibonacci" ? 
+				std::vector<std::string>(1, "2") : SplitList(options.at("alphabets"));
+		for (const std::string& length : SplitList(options.at("lengths"))) {
+			for (const std::string& alphabet : alphabets) {
+				std::string text = GenerateText(distribution, std::stoul(length), 
+						std::stoul(alphabet), options, &generator);
+
+				for (size_t run = 0; run < repeats; ++run) {
+					double seconds = 0;
+					ConstructionStatistics statistics;
+					if (transitions == "dense" && std::stoul(alphabet) <= kFinalAlphabetSize && 
+							distribution != "text") {
+						statistics = MeasureConstruction<LowercaseSuffixTree>(text, pool.get(), &seconds);
+					} else if (transitions == "dense") {
+						statistics = MeasureConstruction<SuffixTree<unsigned char, 
+								DenseTransitions<unsigned char, 256, 0>>>(text, pool.get(), &seconds);
+					} else if (transitions == "sorted") {
+						statistics = MeasureConstruction<ByteSuffixTree>(text, pool.get(), &seconds);
+					} else if (transitions == "hash") {
+						statistics = MeasureConstruction<SuffixTree<unsigned char, 
+								HashTransitions<unsigned char>>>(text, pool.get(), &seconds);
+					} else {
+						throw std::invalid_argument("unknown transitions " + transitions);
+					}
+					double ns_per_char = text.empty() ? 0 : seconds * 1e9 / text.size();
+					// The parallel build runs no Ukkonen phases, so its counters are
+					// left empty in CSV and null in JSON rather than shown as zeros
+					std::string steps_made = pool ? "" : std::to_string(statistics.steps_made);
+					std::string suffix_links_used = pool ? "" : std::to_string(statistics.suffix_links_used);
+
+					if (json) {
+						std::cout << (first_record ? "" : ",\n") << "  {\"distribution\": \"" << distribution 
+								<< "\", \"transitions\": \"" << transitions << "\", \"threads\": " << threads_number 
+								<< ", \"length\": " << text.size() 
+								<< ", \"alphabet\": " << alphabet << ", \"run\": " << run 
+								<< ", \"seconds\": " << seconds << ", \"ns_per_char\": " << ns_per_char 
+								<< ", \"peak_rss_kb\": " << PeakRssKilobytes() 
+								<< ", \"nodes\": " << statistics.nodes << ", \"edges\": " << statistics.edges 
+								<< ", \"leaves\": " << statistics.leaves 
+								<< ", \"steps_made\": " << (pool ? "null" : steps_made) 
+								<< ", \"suffix_links_used\": " << (pool ? "null" : suffix_links_used) << "}";
+					} else {
+						std::cout << distribution << "," << transitions << "," << threads_number << "," << text.size() << "," 
+								<< alphabet << "," << run << "," << seconds << "," << ns_per_char << "," 
+								<< PeakRssKilobytes() << "," << statistics.nodes << "," << statistics.edges << "," 
+								<< statistics.leaves << "," << steps_made << "," 
+								<< suffix_links_used << std::endl;
+					}
+					first_record = false;
+				}
+			}
+		}
+	}
+
+	if (json) {
+		std::cout << std::endl << "]" << std::endl;
+	}
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	BenchmarkOptions options = ParseOptions(argc, argv);
+	if (options.count("print") > 0) {
 		std::string test_string;
-		for (size_t length = 0; length < 100000; ++length) {
-			int randint = 97 + distribution(generate);
-			char randchar = randint;
-			test_string += randchar;
-			//std::cout << randint << std::endl;
-		}
-		//std::cout << test_string << std::endl;
-		SuffixTree suffix_tree;
-		//std::cout << "begin" << std::endl;
+		std::cin >> test_string;
+		ByteSuffixTree suffix_tree;
 		suffix_tree.Initialize(test_string);
-		//std::cout << "end" << std::endl;
-		//for (size_t left_bound = 0; left_bound < test_string.length() - 1; ++left_bound) {
-		//	if (!suffix_tree.IfSuffix(test_string.substr(left_bound,  test_string.length() - left_bound))) {
-		//		std::cout << "NOT" << std::endl;
-		//		suffix_tree.PrintTree();
-		//	}
-		//} 
-		//suffix_tree.PrintTree();
-	}
-	
-	return 0;
+		suffix_tree.PrintTree();
+		return 0;
+	}
+
+	return RunBenchmark(options);
 }